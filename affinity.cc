@@ -0,0 +1,144 @@
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include "main_opts.h"
+#include "affinity.h"
+#include "util.h"
+
+std::vector<int>
+parse_cpu_list(const char *list)
+{
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            throw std::invalid_argument(std::string("bad CPU list: ") + list);
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                throw std::invalid_argument(std::string("bad CPU list: ") + list);
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+                cpus.push_back(cpu);
+        }
+        p = end;
+        if (*p == ',')
+            ++p;
+        else if (*p && *p != '\n')
+            throw std::invalid_argument(std::string("bad CPU list: ") + list);
+        else
+            break;
+    }
+    return cpus;
+}
+
+std::vector<int>
+nic_queue_cpus(const char *iface)
+{
+    /* Queue interrupts are named after interface (eth0-TxRx-0) or after its
+       device (virtio0-input.0, mlx5_comp0@pci:0000:03:00.0). */
+    std::vector<std::string> names{iface};
+    char device[PATH_MAX];
+    std::string link = std::string("/sys/class/net/") + iface + "/device";
+    ssize_t len = readlink(link.c_str(), device, sizeof(device) - 1);
+    if (len > 0) {
+        device[len] = 0;
+        names.push_back(basename(device));
+    }
+
+    std::ifstream interrupts("/proc/interrupts");
+    if (!interrupts)
+        throw Errno("/proc/interrupts");
+    std::vector<int> cpus;
+    std::string line;
+    while (std::getline(interrupts, line)) {
+        std::istringstream fields(line);
+        std::string irq, action;
+        fields >> irq;
+        if (irq.empty() || !isdigit(irq[0]))
+            continue;
+        irq.pop_back();
+        // action names are the last field
+        for (std::string field; fields >> field;)
+            action = field;
+        bool queue = false;
+        for (auto &name: names) {
+            if (action.find(name) != std::string::npos)
+                queue = true;
+        }
+        // device interrupts which are not of receive queues
+        for (const char *other: {"config", "output", "-tx-", "async"}) {
+            if (action.find(other) != std::string::npos)
+                queue = false;
+        }
+        if (!queue)
+            continue;
+        std::ifstream affinity("/proc/irq/" + irq + "/smp_affinity_list");
+        std::string list;
+        if (!std::getline(affinity, list))
+            continue;
+        for (int cpu: parse_cpu_list(list.c_str())) {
+            if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+                cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+void
+pin_thread(pthread_t thread, const std::vector<int> &cpus)
+{
+    if (cpus.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus)
+        CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err) {
+        errno = err;
+        throw Errno("pthread_setaffinity_np");
+    }
+}
+
+static sock_filter
+bpf(uint16_t code, uint32_t k, uint8_t jt = 0, uint8_t jf = 0)
+{
+    sock_filter insn;
+    insn.code = code;
+    insn.jt = jt;
+    insn.jf = jf;
+    insn.k = k;
+    return insn;
+}
+
+void
+attach_reuseport_cpu(int fd, const std::vector<int> &cpus, unsigned group_size)
+{
+    std::vector<sock_filter> code;
+    code.push_back(bpf(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU));
+    for (unsigned i = 0; i < cpus.size() && i < group_size; ++i) {
+        // if (A == cpus[i]) return i;
+        code.push_back(bpf(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1));
+        code.push_back(bpf(BPF_RET | BPF_K, i));
+    }
+    code.push_back(bpf(BPF_ALU | BPF_MOD | BPF_K, group_size));
+    code.push_back(bpf(BPF_RET | BPF_A, 0));
+    sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = code.data();
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        throw Errno("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+}
@@ -0,0 +1,27 @@
+#ifndef __cd_affinity_h
+#define __cd_affinity_h
+
+#include <pthread.h>
+#include <vector>
+
+/* Placement of threads on CPUs. CPU lists are in the kernel format of
+   cpuset and smp_affinity_list: "0-3,8,10-11". */
+
+// throws std::invalid_argument on malformed list
+std::vector<int> parse_cpu_list(const char *list);
+
+/* CPUs which handle interrupts of receive queues of network interface,
+   in order of first appearance in /proc/interrupts. */
+std::vector<int> nic_queue_cpus(const char *iface);
+
+// Restricts thread to cpus; empty list leaves it as is
+void pin_thread(pthread_t thread, const std::vector<int> &cpus);
+
+/* Attaches classic BPF program to SO_REUSEPORT group of listen socket fd:
+   connection is given to the socket with index i in the group (order of
+   listen() calls) if it was received on cpus[i]. For CPUs out of the list
+   (or for all with empty list) socket index is the CPU number modulo
+   group_size. Without such socket the kernel falls back to hash. */
+void attach_reuseport_cpu(int fd, const std::vector<int> &cpus, unsigned group_size);
+
+#endif // __cd_affinity_h
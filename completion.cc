@@ -0,0 +1,85 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "completion.h"
+#include "metrics.h"
+#include "util.h"
+
+CompletionQueue::CompletionQueue()
+{
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0)
+        throw Errno("eventfd");
+}
+
+CompletionQueue::~CompletionQueue()
+{
+    detach();
+    close(event_fd_);
+}
+
+void
+CompletionQueue::attach(struct ev_loop *event_loop)
+{
+    event_loop_ = event_loop;
+    ev_io_init(&event_watcher_, event_callback, event_fd_, EV_READ);
+    event_watcher_.data = this;
+    ev_io_start(event_loop_, &event_watcher_);
+}
+
+void
+CompletionQueue::detach()
+{
+    if (event_loop_) {
+        ev_io_stop(event_loop_, &event_watcher_);
+        event_loop_ = nullptr;
+    }
+}
+
+void
+CompletionQueue::push(CompletionHandler *handler)
+{
+    handler->pushed_at_ = now_ns();
+    CompletionHandler *head = head_.load(std::memory_order_relaxed);
+    do {
+        handler->next_completed_ = head;
+    } while (!head_.compare_exchange_weak(head, handler, std::memory_order_release,
+                                          std::memory_order_relaxed));
+    // the loop is woken once per batch: it takes the whole stack at once
+    if (!head)
+        eventfd_write(event_fd_, 1);
+}
+
+size_t
+CompletionQueue::drain()
+{
+    CompletionHandler *list = head_.exchange(nullptr, std::memory_order_acquire);
+    // stack is in reverse push order
+    CompletionHandler *fifo = nullptr;
+    while (list) {
+        CompletionHandler *next = list->next_completed_;
+        list->next_completed_ = fifo;
+        fifo = list;
+        list = next;
+    }
+    size_t count = 0;
+    while (fifo) {
+        // handler may destroy itself
+        CompletionHandler *next = fifo->next_completed_;
+        fifo->completed();
+        fifo = next;
+        ++count;
+    }
+    completed_ += count;
+    return count;
+}
+
+void
+CompletionQueue::event_callback(EV_P_ ev_io *w, int revents)
+{
+    CompletionQueue *self = (CompletionQueue *) w->data;
+    eventfd_t value;
+    // reset counter before taking the stack: later push wakes the loop again
+    eventfd_read(self->event_fd_, &value);
+    ++self->wakeups_;
+    self->drain();
+}
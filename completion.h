@@ -0,0 +1,75 @@
+#ifndef __cd_completion_h
+#define __cd_completion_h
+
+#include <atomic>
+#include <cstdint>
+#include <ev.h>
+
+class CompletionQueue;
+
+/* Receiver of work done in another thread. It is linked into
+   CompletionQueue through own member, so pushing allocates nothing. */
+class CompletionHandler
+{
+    friend class CompletionQueue;
+    CompletionHandler *next_completed_ = nullptr;
+    uint64_t pushed_at_ = 0;
+
+public:
+    // monotonic time of the last push, nanoseconds
+    uint64_t
+    pushed_at() const
+    {
+        return pushed_at_;
+    }
+
+    // called in thread of event loop which the queue is attached to
+    virtual void completed() = 0;
+};
+
+/* Channel from worker threads to one event loop: lock-free MPSC stack of
+   handlers and one eventfd. Eventfd is written only by push onto empty
+   stack, the loop takes all pushed handlers at once and calls them in push
+   order. So the wakeup costs the same for any number of completions, and
+   nothing is scanned per connection. */
+class CompletionQueue
+{
+    std::atomic<CompletionHandler *> head_{nullptr};
+    int event_fd_ = -1;
+    struct ev_loop *event_loop_ = nullptr;
+    ev_io event_watcher_;
+    // statistics of accept thread: handlers called and wakeups
+    size_t completed_ = 0;
+    size_t wakeups_ = 0;
+
+    CompletionQueue(const CompletionQueue &) = delete;
+
+    static void event_callback(EV_P_ ev_io *w, int revents);
+
+public:
+    CompletionQueue();
+    ~CompletionQueue();
+
+    void attach(struct ev_loop *event_loop);
+    void detach();
+
+    // may be called by any thread
+    void push(CompletionHandler *handler);
+
+    // calls handlers pushed so far; returns their count
+    size_t drain();
+
+    size_t
+    completed() const
+    {
+        return completed_;
+    }
+
+    size_t
+    wakeups() const
+    {
+        return wakeups_;
+    }
+};
+
+#endif // __cd_completion_h
@@ -0,0 +1,487 @@
+#ifndef __cd_coro_h
+#define __cd_coro_h
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <utility>
+#include <ev.h>
+#include "completion.h"
+#include "pool.h"
+
+/* Coroutine handlers of worker event loops. Handler is CoTask coroutine
+   which suspends on co_await of sleep_for(), readable()/writable() of
+   socket or another CoTask (sub-task), so waiting handler holds no thread:
+   one event loop runs any number of them. Root handler is posted to
+   CoScheduler of the loop from any thread; it is started and resumed only
+   in the loop thread, so handlers of one loop don't need locks between
+   them. Sub-task is started by co_await and resumes its caller directly
+   when done. */
+
+class CoScheduler;
+template <class T> class CoTask;
+
+/* Frames of coroutines created by one event loop thread: fixed-size blocks
+   of Pool, so starting a coroutine does not go to global allocator. Root
+   coroutine created by accept thread ends in worker loop, such frame is
+   pushed to lock-free stack of its pool and is taken back by owning thread
+   on its next allocation. */
+class CoFramePool
+{
+public:
+    // enough for handlers of this server, larger frame fails to allocate
+    static const size_t FRAME_SIZE = 512;
+
+private:
+    struct Block
+    {
+        CoFramePool *owner;
+        size_t id;
+        // link of stack of blocks freed by other threads
+        Block *next;
+        alignas(std::max_align_t) char frame[FRAME_SIZE];
+    };
+
+    Pool<Block> pool_;
+    std::atomic<Block *> remote_{nullptr};
+
+    static inline thread_local CoFramePool *current_ = nullptr;
+
+    CoFramePool(const CoFramePool &) = delete;
+
+    void
+    reclaim()
+    {
+        if (!remote_.load(std::memory_order_relaxed))
+            return;
+        Block *block = remote_.exchange(nullptr, std::memory_order_acquire);
+        while (block) {
+            Block *next = block->next;
+            pool_.release(block->id);
+            block = next;
+        }
+    }
+
+public:
+    // capacity is maximum number of frames which exist at once
+    explicit CoFramePool(size_t capacity) :
+        pool_(capacity)
+    {
+    }
+
+    // called in loop thread: coroutines created by the thread take frames here
+    void
+    attach()
+    {
+        current_ = this;
+    }
+
+    // nullptr if thread has no pool, pool is exhausted or frame is too large
+    static void *
+    allocate(size_t size) noexcept
+    {
+        CoFramePool *self = current_;
+        if (!self || size > FRAME_SIZE)
+            return nullptr;
+        self->reclaim();
+        size_t id;
+        Block *block = (Block *) self->pool_.get(id);
+        if (!block)
+            return nullptr;
+        block->owner = self;
+        block->id = id;
+        return block->frame;
+    }
+
+    // may be called by any thread
+    static void
+    deallocate(void *frame) noexcept
+    {
+        Block *block = (Block *) ((char *) frame - offsetof(Block, frame));
+        CoFramePool *owner = block->owner;
+        if (owner == current_) {
+            owner->pool_.release(block->id);
+            return;
+        }
+        Block *head = owner->remote_.load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!owner->remote_.compare_exchange_weak(head, block, std::memory_order_release,
+                                                       std::memory_order_relaxed));
+    }
+};
+
+class CoPromiseBase : public CompletionHandler
+{
+    friend class CoScheduler;
+    template <class T> friend class CoTask;
+
+    // coroutine which awaits this one, none for root
+    std::coroutine_handle<> continuation_;
+    // root posted to scheduler, destroys itself when done
+    CoScheduler *scheduler_ = nullptr;
+
+protected:
+    std::coroutine_handle<> self_;
+    std::exception_ptr exception_;
+
+public:
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    // frame of coroutine is taken from CoFramePool of calling thread
+    static void *
+    operator new(size_t size) noexcept
+    {
+        return CoFramePool::allocate(size);
+    }
+    static void
+    operator delete(void *frame)
+    {
+        CoFramePool::deallocate(frame);
+    }
+
+    // started by co_await or by scheduler
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void
+    unhandled_exception()
+    {
+        // as with std::thread, nobody is there to catch it
+        if (scheduler_)
+            std::terminate();
+        exception_ = std::current_exception();
+    }
+
+    // posted root is taken from queue of scheduler (see CoScheduler::post())
+    virtual void
+    completed()
+    {
+        self_.resume();
+    }
+};
+
+template <class T>
+class CoPromise : public CoPromiseBase
+{
+    T value_{};
+
+public:
+    CoTask<T> get_return_object();
+    // empty task: it is not posted (see CoScheduler::post()), sub-task throws std::bad_alloc
+    static CoTask<T> get_return_object_on_allocation_failure();
+
+    void
+    return_value(T value)
+    {
+        value_ = std::move(value);
+    }
+
+    T
+    result()
+    {
+        if (exception_)
+            std::rethrow_exception(exception_);
+        return std::move(value_);
+    }
+};
+
+template <>
+class CoPromise<void> : public CoPromiseBase
+{
+public:
+    CoTask<void> get_return_object();
+    static CoTask<void> get_return_object_on_allocation_failure();
+
+    void return_void() {}
+
+    void
+    result()
+    {
+        if (exception_)
+            std::rethrow_exception(exception_);
+    }
+};
+
+// Coroutine which is not started until it is awaited or posted
+template <class T = void>
+class CoTask
+{
+    friend class CoScheduler;
+
+public:
+    using promise_type = CoPromise<T>;
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+
+public:
+    explicit CoTask(std::coroutine_handle<promise_type> handle) :
+        handle_{handle}
+    {
+    }
+    CoTask(CoTask &&src) :
+        handle_{std::exchange(src.handle_, nullptr)}
+    {
+    }
+    ~CoTask()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    struct Awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        // frame of sub-task was not allocated
+        bool await_ready() noexcept { return !handle; }
+
+        // caller is suspended and sub-task runs right away in the same thread
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> caller) noexcept
+        {
+            handle.promise().continuation_ = caller;
+            return handle;
+        }
+
+        T
+        await_resume()
+        {
+            if (!handle)
+                throw std::bad_alloc();
+            return handle.promise().result();
+        }
+    };
+
+    Awaiter
+    operator co_await() &&
+    {
+        return Awaiter{handle_};
+    }
+};
+
+template <class T>
+CoTask<T>
+CoPromise<T>::get_return_object()
+{
+    auto handle = std::coroutine_handle<CoPromise>::from_promise(*this);
+    self_ = handle;
+    return CoTask<T>(handle);
+}
+
+inline CoTask<void>
+CoPromise<void>::get_return_object()
+{
+    auto handle = std::coroutine_handle<CoPromise>::from_promise(*this);
+    self_ = handle;
+    return CoTask<void>(handle);
+}
+
+template <class T>
+CoTask<T>
+CoPromise<T>::get_return_object_on_allocation_failure()
+{
+    return CoTask<T>(nullptr);
+}
+
+inline CoTask<void>
+CoPromise<void>::get_return_object_on_allocation_failure()
+{
+    return CoTask<void>(nullptr);
+}
+
+/* Runs posted coroutines in thread of one event loop. Roots are passed
+   through CompletionQueue of the loop, so posting takes no locks and wakes
+   the loop once per batch. Coroutines created in the loop thread take their
+   frames from CoFramePool of the scheduler. */
+class CoScheduler
+{
+    friend class CoPromiseBase;
+
+    CompletionQueue &queue_;
+    CoFramePool frames_;
+    struct ev_loop *event_loop_ = nullptr;
+    // posted roots which are not done, read by other threads for balancing
+    std::atomic<size_t> running_{0};
+
+    static inline thread_local CoScheduler *current_ = nullptr;
+
+    CoScheduler(const CoScheduler &) = delete;
+
+public:
+    /* Queue must be attached to the loop before attach(). frame_capacity is
+       maximum number of coroutines created by the loop thread at once. */
+    CoScheduler(CompletionQueue &queue, size_t frame_capacity) :
+        queue_(queue),
+        frames_(frame_capacity)
+    {
+    }
+
+    // called in loop thread: coroutines of the thread wait in this loop
+    void
+    attach(struct ev_loop *event_loop)
+    {
+        event_loop_ = event_loop;
+        current_ = this;
+        frames_.attach();
+    }
+
+    // scheduler of calling loop thread
+    static CoScheduler &
+    current()
+    {
+        return *current_;
+    }
+
+    struct ev_loop *
+    event_loop() const
+    {
+        return event_loop_;
+    }
+
+    size_t
+    running() const
+    {
+        return running_.load(std::memory_order_relaxed);
+    }
+
+    /* Starts root coroutine in loop thread; may be called by any thread.
+       False if frame of task was not allocated or limit coroutines are running,
+       task is destroyed then. */
+    bool
+    post(CoTask<void> &&task, size_t limit)
+    {
+        if (!task.handle_)
+            return false;
+        // slot is reserved before posting, so concurrent posts don't exceed limit
+        size_t running = running_.load(std::memory_order_relaxed);
+        do {
+            if (running >= limit)
+                return false;
+        } while (!running_.compare_exchange_weak(running, running + 1, std::memory_order_relaxed));
+        CoPromiseBase &promise = std::exchange(task.handle_, nullptr).promise();
+        promise.scheduler_ = this;
+        queue_.push(&promise);
+        return true;
+    }
+};
+
+template <class Promise>
+std::coroutine_handle<>
+CoPromiseBase::FinalAwaiter::await_suspend(std::coroutine_handle<Promise> done) noexcept
+{
+    CoPromiseBase &promise = done.promise();
+    if (promise.continuation_)
+        return promise.continuation_;
+    if (promise.scheduler_) {
+        promise.scheduler_->running_.fetch_sub(1, std::memory_order_relaxed);
+        done.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+/* co_await sleep_for(seconds): resumes after timeout by ev_timer of the
+   loop. Unlike connection timeouts (TimerWheel) sleeps are exact. */
+class SleepAwaiter
+{
+    double seconds_;
+    ev_timer watcher_;
+    std::coroutine_handle<> waiting_;
+
+    static void
+    callback(EV_P_ ev_timer *w, int revents)
+    {
+        ((SleepAwaiter *) w->data)->waiting_.resume();
+    }
+
+public:
+    explicit SleepAwaiter(double seconds) :
+        seconds_{seconds}
+    {
+    }
+
+    bool await_ready() noexcept { return seconds_ <= 0; }
+
+    void
+    await_suspend(std::coroutine_handle<> waiting)
+    {
+        waiting_ = waiting;
+        ev_timer_init(&watcher_, callback, seconds_, 0.);
+        watcher_.data = this;
+        ev_timer_start(CoScheduler::current().event_loop(), &watcher_);
+    }
+
+    void await_resume() noexcept {}
+};
+
+inline SleepAwaiter
+sleep_for(double seconds)
+{
+    return SleepAwaiter(seconds);
+}
+
+/* co_await readable(fd) or writable(fd): resumes when socket is ready;
+   result is libev revents (EV_READ, EV_WRITE). */
+class IoAwaiter
+{
+    int fd_;
+    int events_;
+    int revents_ = 0;
+    ev_io watcher_;
+    std::coroutine_handle<> waiting_;
+
+    static void
+    callback(EV_P_ ev_io *w, int revents)
+    {
+        IoAwaiter *self = (IoAwaiter *) w->data;
+        ev_io_stop(EV_A_ w);
+        self->revents_ = revents;
+        self->waiting_.resume();
+    }
+
+public:
+    IoAwaiter(int fd, int events) :
+        fd_{fd},
+        events_{events}
+    {
+    }
+
+    bool await_ready() noexcept { return false; }
+
+    void
+    await_suspend(std::coroutine_handle<> waiting)
+    {
+        waiting_ = waiting;
+        ev_io_init(&watcher_, callback, fd_, events_);
+        watcher_.data = this;
+        ev_io_start(CoScheduler::current().event_loop(), &watcher_);
+    }
+
+    int await_resume() noexcept { return revents_; }
+};
+
+inline IoAwaiter
+readable(int fd)
+{
+    return IoAwaiter(fd, EV_READ);
+}
+
+inline IoAwaiter
+writable(int fd)
+{
+    return IoAwaiter(fd, EV_WRITE);
+}
+
+#endif // __cd_coro_h
@@ -0,0 +1,116 @@
+#ifndef __cd_histogram_h
+#define __cd_histogram_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Log-linear histogram of the HDR kind: values below 2^SUB_BITS are counted
+   exactly, bigger ones in buckets of relative width 2^-(SUB_BITS-1), so any
+   percentile is within 1% of the real value for the whole 64-bit range.
+   Recording is an index computation and an increment, histograms of
+   different threads are merged for report. Not thread-safe. */
+class Histogram
+{
+public:
+    static const unsigned SUB_BITS = 7;
+    static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static const uint64_t HALF_COUNT = SUB_COUNT / 2;
+    static const size_t BUCKETS = SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT;
+
+private:
+    uint64_t counts_[BUCKETS];
+    uint64_t total_;
+    uint64_t min_;
+    uint64_t max_;
+    double sum_;
+
+public:
+    // bucket of value
+    static size_t
+    index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+            return value;
+        unsigned shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        return SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+    }
+
+    // highest value counted in bucket
+    static uint64_t
+    bucket_value(size_t idx)
+    {
+        if (idx < SUB_COUNT)
+            return idx;
+        unsigned shift = (idx - SUB_COUNT) / HALF_COUNT + 1;
+        uint64_t mantissa = (idx - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    Histogram()
+    {
+        reset();
+    }
+
+    void
+    reset()
+    {
+        memset(counts_, 0, sizeof(counts_));
+        total_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+        sum_ = 0;
+    }
+
+    void
+    record(uint64_t value, uint64_t count = 1)
+    {
+        counts_[index(value)] += count;
+        total_ += count;
+        sum_ += (double) value * count;
+        if (value < min_)
+            min_ = value;
+        if (value > max_)
+            max_ = value;
+    }
+
+    void
+    merge(const Histogram &other)
+    {
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        if (other.min_ < min_)
+            min_ = other.min_;
+        if (other.max_ > max_)
+            max_ = other.max_;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t min() const { return total_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? sum_ / total_ : 0; }
+
+    // Value below which percent of recorded values are; percent is in [0, 100]
+    uint64_t
+    percentile(double percent) const
+    {
+        if (!total_)
+            return 0;
+        uint64_t rank = (uint64_t) (percent / 100 * total_ + 0.5);
+        if (rank < 1)
+            rank = 1;
+        if (rank > total_)
+            rank = total_;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank)
+                return bucket_value(i) < max_ ? bucket_value(i) : max_;
+        }
+        return max_;
+    }
+};
+
+#endif // __cd_histogram_h
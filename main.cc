@@ -1,282 +1,804 @@
 #include <iostream>
 #include <cstdio>
 #include <cstring>
+#include <strings.h>
 #include <unistd.h>
 #include "main_opts.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ev.h>
+#include <deque>
 
 #include "threads.h"
 #include "pool.h"
+#include "uring.h"
+#include "response.h"
+#include "parser.h"
+#include "ringbuf.h"
+#include "completion.h"
+#include "timer_wheel.h"
+#include "coro.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "trace.h"
 #include "util.h"
 
-const std::string CRLF("\r\n");
-const std::string GET("GET ");
-const std::string QUERY_FAST("/test/fast");
-const std::string QUERY_SLOW("/test/slow");
-const std::string RESPONSE(
-    "HTTP/1.1 200 OK\r\n"
-    "Connection: close\r\n"
-    "Content-Length: 0\r\n"
-    "\r\n");
-
 ThreadPool thread_pool;
+// filled in main() before accept threads are started
+ResponseTable responses;
 
-class ReqParser
-{
-public:
-    enum Status {
-        // Terminate connection
-        TERMINATE = 0,
-        // Continue current phase
-        CONTINUE,
-        // Proceed to next phase
-        PROCEED
-    };
+// number of accept threads which are doing offloaded work inline (see --accept-workers)
+std::atomic<int> busy_accept_workers{0};
+// offloaded requests run by this accept thread in its own loop
+static thread_local size_t accept_worker_tasks = 0;
 
-    enum Service {
-        NOT_DEFINED = 0,
-        FAST,
-        SLOW
-    };
+/* Accept thread is busy while it runs any inline task; busy one takes
+   more tasks up to --task-queue, as worker loop does. */
+bool
+take_accept_worker()
+{
+    if (!accept_worker_tasks) {
+        int busy = busy_accept_workers.load(std::memory_order_relaxed);
+        do {
+            if (busy >= OPT_VALUE_ACCEPT_WORKERS)
+                return false;
+        } while (!busy_accept_workers.compare_exchange_weak(busy, busy + 1, std::memory_order_relaxed));
+    } else if (accept_worker_tasks >= (size_t) OPT_VALUE_TASK_QUEUE) {
+        return false;
+    }
+    ++accept_worker_tasks;
+    return true;
+}
 
-private:
-    typedef Status(ReqParser::*parse_f)();
-    parse_f parse;
-    char *full_buf;
-    size_t &received_size;
-    size_t crlf_scan = 0;
-    char *crlf_prev = nullptr; // detection of CRLFCRLF sequence
-    bool method_ok = false;
+void
+release_accept_worker()
+{
+    if (--accept_worker_tasks == 0)
+        busy_accept_workers.fetch_sub(1, std::memory_order_relaxed);
+}
 
-public:
-    size_t requestline_size = 0;
-    size_t uri_start = 0;
-    size_t uri_size = 0;
-    Service service = NOT_DEFINED;
+class SlowTask : public Task
+{
+    CompletionQueue *completions;
+    CompletionHandler *handler;
+    uint64_t enqueued;
+    // connection replies 504 after this moment, the work is not needed then; 0 - none
+    uint64_t deadline;
 
 public:
-    char *
-    scan_for(const std::string& pattern, size_t &scan_start)
+    SlowTask(CompletionQueue *q, CompletionHandler *h) :
+        completions{q},
+        handler{h},
+        enqueued{now_ns()},
+        deadline{OPT_VALUE_TASK_TIMEOUT ? enqueued + OPT_VALUE_TASK_TIMEOUT * 1000000ull : 0}
+    {
+    }
+    virtual ~SlowTask()
     {
-        if (scan_start >= received_size)
+    }
+    // the work itself
+    static void
+    process()
+    {
+        usleep(OPT_VALUE_SLOW_DURATION * 1000);
+    }
+    // the same work of coroutine: loop serves others while it waits
+    static CoTask<>
+    process_async()
+    {
+        co_await sleep_for(OPT_VALUE_SLOW_DURATION / 1000.);
+    }
+    // returns start time; zero if deadline has passed in queue and the work is not needed
+    uint64_t
+    begin()
+    {
+        debug("SlowTask is started");
+        count(TASKS_STARTED);
+        uint64_t started = now_ns();
+        stage(STAGE_QUEUE, enqueued, started);
+        trace(TRACE_TASK_START, (uintptr_t) handler, started - enqueued);
+        if (deadline && started >= deadline) {
+            debug("SlowTask deadline has passed in queue, skipping it");
             return 0;
-        size_t scan_size = received_size - scan_start;
-        if (scan_size >= pattern.size()) {
-            char *found = (char *) memmem(
-                &full_buf[scan_start],
-                scan_size,
-                pattern.data(),
-                pattern.size());
-
-            if (found) {
-                scan_start = found - full_buf + pattern.size();
-                return found;
-            }
-            scan_start = received_size - pattern.size() + 1;
         }
-        return 0;
+        return started;
     }
+    void
+    end(uint64_t started)
+    {
+        if (started) {
+            debug("SlowTask is ended");
+            stage(STAGE_EXECUTE, started, now_ns());
+        }
+        trace(TRACE_TASK_END, (uintptr_t) handler);
+        // handler may be destroyed right after push
+        completions->push(handler);
+    }
+    virtual void execute()
+    {
+        uint64_t started = begin();
+        if (started)
+            process();
+        end(started);
+    }
+    // Task as root coroutine of worker loop (see --coroutines)
+    static CoTask<>
+    run(SlowTask task)
+    {
+        uint64_t started = task.begin();
+        if (started)
+            co_await process_async();
+        task.end(started);
+    }
+    // Task as root coroutine of accept thread loop acting as worker (see --accept-workers)
+    static CoTask<>
+    run_inline(SlowTask task)
+    {
+        co_await run(std::move(task));
+        release_accept_worker();
+    }
+};
 
-    bool compare(const std::string& s1, const char* s2, size_t s2_size)
+/* Request data of connection: ring buffer and parser state. Connection leases
+   it from accept thread only while request is received and parsed, idle
+   connection keeps only ConnectionCtx. */
+class ConnBuffer : public OnPool<ConnBuffer>
+{
+    RingSlab &slab;
+
+public:
+    RingBuffer ring;
+    // current request start in ring, the whole ring size is contiguous from here
+    char *full_buf = nullptr;
+    char *recv_buf = nullptr;
+    size_t received_size = 0;
+    ReqParser parser;
+
+    ConnBuffer(RingSlab &slab_) :
+        slab(slab_),
+        parser(nullptr, slab_.size(), received_size)
+    {
+        slab.acquire(ring);
+        full_buf = recv_buf = ring.data();
+        parser.reset(full_buf);
+        count(BUFFERS_LEASED);
+    }
+    ConnBuffer(const ConnBuffer&) = delete;
+    ~ConnBuffer()
     {
-        return (s1.size() == s2_size && 0 == memcmp(s1.data(), s2, s2_size));
+        slab.release(ring, received_size);
+        count(BUFFERS_RELEASED);
     }
 
-    bool match_uri()
+    // Drop parsed request, pipelined data stays in place; returns size of pipelined data
+    size_t
+    next_request()
     {
-        assert(requestline_size && uri_start && uri_start <= requestline_size);
-        while (uri_start < requestline_size && full_buf[uri_start] == ' ')
-            ++uri_start;
-        size_t rest_size = requestline_size - uri_start;
-        if (rest_size == 0)
-            return false;
-        char *uri_end = 0;
-        if (rest_size > 1)
-            uri_end = (char *) memchr(&full_buf[uri_start + 1], ' ', rest_size - 1);
-        uri_size = uri_end ? uri_end - &full_buf[uri_start] : rest_size;
+        size_t rest_size = received_size - parser.request_size;
+        full_buf = ring.consume(parser.request_size, rest_size);
+        received_size = rest_size;
+        recv_buf = &full_buf[rest_size];
+        parser.reset(full_buf);
+        return rest_size;
+    }
+};
 
-        if (compare(QUERY_FAST, &full_buf[uri_start], uri_size)) {
-            service = FAST;
-            return true;
-        }
-        if (compare(QUERY_SLOW, &full_buf[uri_start], uri_size)) {
-            service = SLOW;
-            return true;
-        }
-        return false;
+INIT_POOL(ConnBuffer);
+
+/* Connection which has received data while no buffer is free. It is linked
+   into queue of BufferPool through own members, as TimerHandler is. */
+class BufferWaiter
+{
+    friend class BufferPool;
+    BufferWaiter *next_waiter_ = nullptr;
+    // link which points to this, nullptr when not waiting
+    BufferWaiter **pprev_waiter_ = nullptr;
+
+public:
+    // buffer is leased for the waiter; called by event loop, not inside release of buffer
+    virtual void buffer_available(ConnBuffer *buf) = 0;
+
+    bool
+    waiting() const
+    {
+        return pprev_waiter_ != nullptr;
     }
+};
 
-    Status
-    find_crlf()
+/* Connection buffers of one event loop thread. When they are exhausted,
+   connections wait in FIFO order and get buffers as they are released. */
+class BufferPool
+{
+    Pool<ConnBuffer> pool;
+    RingSlab slab;
+    BufferWaiter *waiters = nullptr;
+    BufferWaiter **waiters_tail = &waiters;
+    struct ev_loop *event_loop = nullptr;
+    // hands out released buffers on the next loop iteration
+    ev_timer resume_watcher;
+
+    static void
+    resume_callback(EV_P_ ev_timer *w, int revents)
     {
-        char *crlf = scan_for(CRLF, crlf_scan);
-        if (crlf) {
-            if (!method_ok) {
-                debug("wrong method!");
-                return TERMINATE;
-            }
-            if (crlf_prev) {
-                if (crlf - crlf_prev == CRLF.size()) {
-                    return PROCEED; // found CRLFCRLF sequence
-                }
-            } else {
-                requestline_size = crlf - full_buf;
-                if (!match_uri()) {
-                    debug("wrong query!");
-                    return TERMINATE;
-                }
-            }
-            crlf_prev = crlf;
-        }
-        return CONTINUE;
+        ((BufferPool *) w->data)->resume();
     }
 
-    Status
-    check_method()
+    void
+    resume()
     {
-        if (received_size >= GET.size()) {
-            method_ok = (0 == memcmp(full_buf, GET.data(), GET.size()));
-            if (!method_ok) {
-                debug("wrong method!");
-                return TERMINATE;
-            }
-            if (crlf_scan < GET.size())
-                crlf_scan = GET.size();
-            parse = &ReqParser::find_crlf;
-            uri_start = GET.size();
+        while (waiters) {
+            ConnBuffer *buf = lease();
+            if (!buf)
+                return;
+            BufferWaiter *w = waiters;
+            cancel(w);
+            w->buffer_available(buf);
         }
+    }
 
-        if (received_size < CRLF.size())
-            return CONTINUE;
+public:
+    BufferPool(size_t buf_size, size_t capacity) :
+        pool(capacity, ENABLED_OPT(POOL_HUGEPAGES)),
+        slab(buf_size, capacity)
+    {
+        ev_timer_init(&resume_watcher, resume_callback, 0., 0.);
+        resume_watcher.data = this;
+    }
+    ~BufferPool()
+    {
+        if (event_loop)
+            ev_timer_stop(event_loop, &resume_watcher);
+    }
 
-        Status res = CONTINUE;
-        while (res == CONTINUE && crlf_scan <= received_size - CRLF.size())
-            res = find_crlf();
+    // called in loop thread before connections are served
+    void
+    attach(struct ev_loop *event_loop_)
+    {
+        event_loop = event_loop_;
+    }
 
-        return res;
+    // Memory of parser states; ring buffers take address space, memory is used by touched pages only
+    static size_t
+    memsize(size_t capacity)
+    {
+        return Pool<ConnBuffer>::memsize(capacity, ENABLED_OPT(POOL_HUGEPAGES));
     }
 
-    ReqParser(char *full_buf_, size_t &received_size_) :
-        parse{&ReqParser::check_method},
-        full_buf{full_buf_},
-        received_size{received_size_}
+    void
+    trim()
     {
+        pool.trim();
     }
 
-    Status
-    operator()()
+    size_t
+    size() const
     {
-        return (this->*parse)();
+        return pool.size();
     }
-};
 
-class SlowTask : public Task
-{
-    struct ev_loop *event_loop;
-    ev_async *async_watcher;
+    size_t
+    max_size() const
+    {
+        return pool.max_size();
+    }
 
-public:
-    SlowTask(struct ev_loop* l, ev_async *w) :
-        event_loop{l},
-        async_watcher{w}
+    size_t
+    committed_size() const
     {
+        return pool.committed_size();
     }
-    virtual ~SlowTask()
+
+    // nullptr when all buffers are leased
+    ConnBuffer *
+    lease()
     {
+        if (pool.full())
+            return nullptr;
+        try {
+            return new (pool) ConnBuffer(slab);
+        } catch (std::bad_alloc &) {
+            return nullptr;
+        }
     }
-    virtual void execute()
+
+    void
+    release(ConnBuffer *buf)
     {
-        debug("SlowTask is started");
-        usleep(OPT_VALUE_SLOW_DURATION * 1000);
-        ev_async_send(event_loop, async_watcher);
-        debug("SlowTask is ended");
+        if (!buf)
+            return;
+        delete buf;
+        if (waiters)
+            ev_timer_start(event_loop, &resume_watcher);
+    }
+
+    // w->buffer_available() is called when buffer is released
+    void
+    wait(BufferWaiter *w)
+    {
+        assert(!w->waiting());
+        w->pprev_waiter_ = waiters_tail;
+        *waiters_tail = w;
+        waiters_tail = &w->next_waiter_;
+    }
+
+    void
+    cancel(BufferWaiter *w)
+    {
+        if (!w->waiting())
+            return;
+        *w->pprev_waiter_ = w->next_waiter_;
+        if (w->next_waiter_)
+            w->next_waiter_->pprev_waiter_ = w->pprev_waiter_;
+        else
+            waiters_tail = w->pprev_waiter_;
+        w->next_waiter_ = nullptr;
+        w->pprev_waiter_ = nullptr;
     }
 };
 
-class ConnectionCtx : public OnPool<ConnectionCtx>
+class LoopWorker;
+
+/* Replies built per request (statistics) which are free for connections of the thread.
+   They are reused, so serving such request allocates nothing once strings have grown. */
+static thread_local vector<Response *> free_own_responses;
+
+// resolution of connection timeouts, seconds
+static const double TIMER_TICK = 0.01;
+
+class ConnectionCtx : public OnPool<ConnectionCtx>, public URingHandler, public CompletionHandler,
+                      public TimerHandler, public BufferWaiter
 {
-    static const size_t buf_size = 4096;
+    // thread which serves the connection
+    enum Home {
+        // accept thread
+        AT_HOME = 0,
+        // worker loop which adopted connection
+        ADOPTED,
+        // passed to worker loop
+        LEAVING,
+        // worker loop adopted connection, this context is to be released by owning thread
+        LEFT,
+        // worker loop could not adopt connection, owning thread serves it further
+        BOUNCED
+    };
+
     struct ev_loop *event_loop;
+    // io_uring mode: I/O is done by ring, conn_watcher only keeps socket descriptor
+    URing *uring;
     ev_io conn_watcher;
-    ev_async async_watcher;
-    char full_buf[buf_size + 1];
-    char *recv_buf = full_buf;
-    size_t received_size = 0;
-    ReqParser parser;
+    // worker threads report done tasks here
+    CompletionQueue &completions;
+    BufferPool &buffers;
+    // timers of event loop thread
+    TimerWheel &timers;
+    // what armed timer waits for
+    enum Timeout {
+        // request head, since accept or first byte of request
+        HEADER_TIMEOUT = 0,
+        // next request on keep-alive connection
+        IDLE_TIMEOUT,
+        // done offloaded task
+        TASK_TIMEOUT
+    };
+    Timeout timeout = HEADER_TIMEOUT;
+    // 504 is sent, result of task is not needed
+    bool task_timed_out = false;
+    // leased while request is received and parsed
+    ConnBuffer *buf = nullptr;
     bool read_expected = true;
-    ssize_t sent_size = 0;
+    // result of parsed request, kept when buffer is given back
+    bool keep_alive = false;
+    bool head_request = false;
+    Service service = NOT_DEFINED;
+    size_t sent_size = 0;
+    const Response *response = nullptr;
+    bool send_body = true;
     bool async_task = false;
+    // MSG_ZEROCOPY completion notifications may wait in socket error queue
+    bool zerocopy_pending = false;
+    Home home = AT_HOME;
+    // worker loop which serves or is to adopt connection
+    LoopWorker *loop_worker = nullptr;
+    // time of accept, zero after first request starts
+    uint64_t accepted_at = 0;
+    // time of first byte of current request
+    uint64_t request_start = 0;
+    // time when sending of reply started
+    uint64_t reply_start = 0;
+    // reply built for this request only (statistics), until it is sent
+    Response *own_response = nullptr;
+
+    // io_uring operations in flight
+    enum URingOp {
+        OP_RECV = 0,
+        OP_SEND,
+        OP_CLOSE,
+        OP_CANCEL,
+        OP_POLL
+    };
+    bool recv_inflight = false;
+    bool poll_inflight = false;
+    bool send_inflight = false;
+    bool close_inflight = false;
+    bool cancel_inflight = false;
+    bool notif_inflight = false;
+    bool closing = false;
+    // data which waits for free buffer in provided buffer (see recv_provided())
+    int provided_size = 0;
+    unsigned provided_id = 0;
+    // io_uring reads it when send is executed
+    struct msghdr send_msg;
+    struct iovec send_iov[2];
+
+    bool uring_inflight()
+    {
+        return recv_inflight || poll_inflight || send_inflight || close_inflight || cancel_inflight || notif_inflight;
+    }
+
+    Response &lease_own_response()
+    {
+        if (!own_response) {
+            if (free_own_responses.empty()) {
+                own_response = new Response;
+            } else {
+                own_response = free_own_responses.back();
+                free_own_responses.pop_back();
+            }
+        }
+        return *own_response;
+    }
+
+    void release_own_response()
+    {
+        if (own_response) {
+            free_own_responses.push_back(own_response);
+            own_response = nullptr;
+        }
+    }
+
+    bool lease_buffer()
+    {
+        if (!buf)
+            buf = buffers.lease();
+        return buf != nullptr;
+    }
+
+    void release_buffer()
+    {
+        buffers.release(buf);
+        buf = nullptr;
+    }
+
+    // Data has come but no buffer is free: reading stops until buffer_available()
+    void wait_buffer()
+    {
+        debug("no free connection buffer, waiting for one");
+        if (!uring)
+            ev_io_stop(event_loop, &conn_watcher);
+        buffers.wait(this);
+    }
+
+    virtual void buffer_available(ConnBuffer *leased)
+    {
+        buf = leased;
+        if (!uring) {
+            // watcher is level-triggered, data is read on next iteration
+            ev_io_start(event_loop, &conn_watcher);
+            return;
+        }
+        if (provided_size) {
+            int res = provided_size;
+            provided_size = 0;
+            recv_provided(res, provided_id);
+            return;
+        }
+        uring_recv();
+    }
+
+    void set_events(int events)
+    {
+        if (uring) {
+            /* Recv is armed only while request is read, so buffer is never
+               modified by kernel when it is not expected (see next_request()). */
+            if ((events & EV_READ) && read_expected)
+                uring_recv();
+            if (events & EV_WRITE)
+                uring_send();
+            return;
+        }
+        ev_io_stop(event_loop, &conn_watcher);
+        conn_watcher.events = events;
+        ev_io_start(event_loop, &conn_watcher);
+    }
+
+    /* Without buffer connection receives into buffer which accept thread provided
+       to kernel, and copies data to leased buffer (see recv_provided()); when all
+       provided buffers are taken, it waits for data by poll. So idle connection
+       does not hold buffer, and request is usually received by one operation. */
+    void uring_recv(bool poll = false)
+    {
+        if (recv_inflight || poll_inflight)
+            return;
+        if (!buf) {
+            if (poll || !uring->provided_buffers()) {
+                uring->poll(this, OP_POLL, conn_watcher.fd, POLLIN);
+                poll_inflight = true;
+                return;
+            }
+            uring->recv_provided(this, OP_RECV, conn_watcher.fd, 0);
+            recv_inflight = true;
+            return;
+        }
+        if (buf->received_size >= buf->ring.size())
+            return;
+        uring->recv(this, OP_RECV, conn_watcher.fd, buf->recv_buf, buf->ring.size() - buf->received_size, 0);
+        recv_inflight = true;
+    }
+
+    void uring_send()
+    {
+        if (send_inflight)
+            return;
+        memset(&send_msg, 0, sizeof(send_msg));
+        send_msg.msg_iov = send_iov;
+        send_msg.msg_iovlen = response->unsent(sent_size, send_iov, send_body);
+        io_uring_sqe *sqe = uring->sendmsg(this, OP_SEND, conn_watcher.fd, &send_msg,
+                                           MSG_NOSIGNAL | MSG_WAITALL, zerocopy());
+        send_inflight = true;
+        if (!keep_alive) {
+            // last reply on connection: close socket right after it is sent
+            sqe->flags |= IOSQE_IO_LINK;
+            uring->close(this, OP_CLOSE, conn_watcher.fd);
+            close_inflight = true;
+        }
+    }
+
+    virtual void complete(int op, int res, unsigned flags)
+    {
+        switch (op) {
+            case OP_RECV:
+                recv_inflight = false;
+                break;
+            case OP_POLL:
+                poll_inflight = false;
+                break;
+            case OP_SEND:
+                if (flags & IORING_CQE_F_NOTIF) {
+                    // zero-copy send released response buffers
+                    notif_inflight = false;
+                    break;
+                }
+                send_inflight = false;
+                if (flags & IORING_CQE_F_MORE)
+                    notif_inflight = true;
+                break;
+            case OP_CLOSE:
+                close_inflight = false;
+                // on success socket is closed; otherwise link was broken and destructor closes it
+                if (res == 0)
+                    conn_watcher.fd = 0;
+                break;
+            case OP_CANCEL:
+                cancel_inflight = false;
+                break;
+        }
+        if (closing) {
+            if (op == OP_RECV && (flags & IORING_CQE_F_BUFFER))
+                uring->recycle_buffer(URing::buffer_id(flags));
+            if (!uring_inflight())
+                finish();
+            return;
+        }
+        switch (op) {
+            case OP_RECV:
+                if (flags & IORING_CQE_F_BUFFER)
+                    recv_provided(res, URing::buffer_id(flags));
+                else if (res == -EAGAIN)
+                    uring_recv();
+                else if (res == -ENOBUFS)
+                    // all provided buffers are taken
+                    uring_recv(true);
+                else
+                    on_read(res);
+                return;
+            case OP_POLL:
+                if (res < 0) {
+                    on_read(res);
+                    return;
+                }
+                if (!lease_buffer()) {
+                    wait_buffer();
+                    return;
+                }
+                uring_recv();
+                return;
+            case OP_SEND:
+                if (flags & IORING_CQE_F_NOTIF)
+                    return;
+                if (close_inflight || conn_watcher.fd == 0) {
+                    // socket is closed by linked close, nothing more can be sent
+                    finish();
+                    return;
+                }
+                on_write(res);
+                return;
+        }
+    }
+
+    // Data is received into provided buffer id: it is copied and the buffer is given back right away
+    void recv_provided(int res, unsigned id)
+    {
+        if (res > 0 && !lease_buffer()) {
+            // data stays in provided buffer until connection gets its own
+            provided_size = res;
+            provided_id = id;
+            wait_buffer();
+            return;
+        }
+        if (res > 0)
+            memcpy(buf->recv_buf, uring->buffer(id), res);
+        uring->recycle_buffer(id);
+        on_read(res);
+    }
+
+    // Destroy connection; in io_uring mode it waits for operations in flight
+    void finish()
+    {
+        if (uring && uring_inflight()) {
+            closing = true;
+            if ((recv_inflight || poll_inflight) && !cancel_inflight) {
+                uring->cancel(this, OP_CANCEL, this, recv_inflight ? OP_RECV : OP_POLL);
+                cancel_inflight = true;
+            }
+            return;
+        }
+        if (async_task) {
+            // worker thread refers to connection until task_done()
+            terminate();
+            return;
+        }
+        delete this;
+    }
 
     void read_conn()
     {
-        size_t recv_size = recv(conn_watcher.fd, recv_buf, buf_size - received_size, 0);
-        if (recv_size == 0) {
+        if (!lease_buffer()) {
+            wait_buffer();
+            return;
+        }
+        ssize_t recv_size = recv(conn_watcher.fd, buf->recv_buf, buf->ring.size() - buf->received_size, 0);
+        if (recv_size == -1 && errno == EAGAIN) {
+            if (buf->received_size == 0)
+                release_buffer();
+            return;
+        }
+        on_read(recv_size == -1 ? -errno : recv_size);
+    }
+
+    // res is received size or negative errno
+    void on_read(ssize_t res)
+    {
+        if (res == 0) {
             debug ("peer shutdown");
-            delete this;
+            finish();
             return;
         }
-        if (recv_size == -1) {
-            switch (errno) {
+        if (res < 0) {
+            switch (-res) {
                 case ENOTCONN:
+                case ECONNRESET:
                     debug ("peer reset");
-                    delete this;
-                    return;
-                case EAGAIN:
+                    finish();
                     return;
                 default:
+                    errno = -res;
                     throw Errno("recv");
             }
         }
-        received_size += recv_size;
-        recv_buf += recv_size;
-        assert (received_size <= buf_size);
+        if (buf->received_size == 0) {
+            request_start = now_ns();
+            if (accepted_at) {
+                // header timeout of first request runs since accept
+                stage(STAGE_ACCEPT, accepted_at, request_start);
+                accepted_at = 0;
+            } else {
+                set_timeout(HEADER_TIMEOUT);
+            }
+            trace(TRACE_REQUEST_START, (uintptr_t) this, res);
+        }
+        buf->received_size += res;
+        buf->recv_buf += res;
+        assert (buf->received_size <= buf->ring.size());
+        parse_request();
+    }
 
+    void parse_request()
+    {
+        ReqParser &parser = buf->parser;
         ReqParser::Status s = parser();
+        // decoding of chunked body shrinks received data
+        buf->recv_buf = &buf->full_buf[buf->received_size];
         switch(s) {
             case ReqParser::TERMINATE:
-                delete this;
+                count(PARSE_FAILURES);
+                trace(TRACE_PARSE_FAIL, (uintptr_t) this, buf->received_size);
+                finish();
                 return;
             case ReqParser::PROCEED: // reached request end
-                debug("got request service ", parser.service);
+                debug("got request: ", ReqParser::method_name(parser.method), " service ", parser.service,
+                      " body ", parser.body_size, " bytes");
                 read_expected = false;
-                if (parser.service == ReqParser::FAST || OPT_VALUE_WORKER_THREADS == 0) {
-                    /* For fast request we do processing inside accept thread.
-                       In this example there is no processing at all, we just activate
+                timers.cancel(this);
+                keep_alive = parser.keep_alive;
+                head_request = parser.method == ReqParser::HEAD;
+                service = parser.service;
+                response = &responses.route(service, keep_alive);
+                count(REQUESTS);
+                stage(STAGE_READ, request_start, now_ns());
+                trace(TRACE_PARSE_DONE, (uintptr_t) this, service);
+                if (service == STATS) {
+                    Response &stats = lease_own_response();
+                    metrics.report(stats.body(), thread_pool.queue_high_water());
+                    stats.set_header(200, keep_alive);
+                    response = &stats;
+                }
+                if (buf->received_size == parser.request_size) {
+                    // nothing is pipelined, buffer is not needed until next request
+                    release_buffer();
+                }
+                if (ROUTES[service].handler == MIGRATE && can_migrate()) {
+                    migrate();
+                } else if (ROUTES[service].handler != OFFLOAD || (OPT_VALUE_WORKER_THREADS == 0 && !ENABLED_OPT(COROUTINES))) {
+                    /* For inline route we do processing inside accept thread.
+                       In this example there is no processing at all, we just start
                        response sending. */
-                    ev_io_stop(event_loop, &conn_watcher);
-                    conn_watcher.events = EV_READ | EV_WRITE;
-                    ev_io_start(event_loop, &conn_watcher);
+                    reply();
                 } else {
-                    /* Push slow task into thread pool. Note, that read event is still active
+                    /* Push task of offloaded route into thread pool or worker loop. Note, that read event is still active
                        in event loop. So, we terminate connection on unexpected read.
                        Asynchronous task must be aware of it! */
-                    ev_async_start(event_loop, &async_watcher);
-                    SlowTask task (event_loop, &async_watcher);
-                    thread_pool.add_task(task);
+                    // worker may start the task before offload() returns
+                    trace(TRACE_TASK_ENQUEUE, (uintptr_t) this, (uintptr_t) static_cast<CompletionHandler *>(this));
+                    if (!offload()) {
+                        /* Task queue is full: shed load instead of waiting. */
+                        debug("task queue is full, rejecting request");
+                        count(REJECTED);
+                        trace(TRACE_TASK_REJECT, (uintptr_t) this);
+                        keep_alive = false;
+                        response = &responses.unavailable();
+                        reply();
+                        return;
+                    }
                     async_task = true;
+                    set_timeout(TASK_TIMEOUT);
+                    count(OFFLOADED);
+                    report_queue_depth();
                 }
                 return;
             default:
                 break;
         }
 
-        if (received_size >= buf_size) {
-            // TODO: mmap-based ring buffer (see https://github.com/willemt/cbuffer)
-            error("Not enough buffer!");
-            delete this;
+        if (buf->received_size >= buf->ring.size()) {
+            error("Request does not fit into buffer!");
+            count(PARSE_FAILURES);
+            trace(TRACE_PARSE_FAIL, (uintptr_t) this, buf->received_size);
+            finish();
             return;
         }
+        if (uring)
+            uring_recv();
     }
 
     void terminate()
     {
-        if (conn_watcher.fd) {
+        if (conn_watcher.fd && !close_inflight) {
             debug("terminating connection");
             ev_io_stop(event_loop, &conn_watcher);
             close(conn_watcher.fd);
@@ -286,16 +808,33 @@ class ConnectionCtx : public OnPool<ConnectionCtx>
 
     void read_unexpected()
     {
-        char buf[1];
-        size_t recv_size = recv(conn_watcher.fd, buf, 1, 0);
+        char one[1];
+        char *read_buf = one;
+        size_t read_size = 1;
+        if (keep_alive) {
+            /* Pipelined request: keep it in ring after current one.
+               It will be parsed when current response is sent. */
+            if (!lease_buffer() || buf->received_size >= buf->ring.size()) {
+                // stop reading until current response is sent
+                if (async_task)
+                    ev_io_stop(event_loop, &conn_watcher);
+                else
+                    set_events(EV_WRITE);
+                return;
+            }
+            read_buf = buf->recv_buf;
+            read_size = buf->ring.size() - buf->received_size;
+        }
+        ssize_t recv_size = recv(conn_watcher.fd, read_buf, read_size, 0);
         if (recv_size == -1) {
             switch (errno) {
                 case ENOTCONN:
+                case ECONNRESET:
                     debug ("peer reset");
                     if (async_task)
                         terminate();
                     else
-                        delete this;
+                        finish();
                     return;
                 case EAGAIN:
                     return;
@@ -303,32 +842,166 @@ class ConnectionCtx : public OnPool<ConnectionCtx>
                     throw Errno("recv");
             }
         }
-        if (recv_size == 0)
+        if (recv_size == 0) {
             debug("peer shutdown");
-        else
+        } else if (keep_alive) {
+            debug("pipelined read");
+            buf->received_size += recv_size;
+            buf->recv_buf += recv_size;
+            return;
+        } else {
             debug("unexpected read!");
+        }
         if (async_task)
             terminate();
         else
-            delete this;
+            finish();
         return;
     }
 
+    void next_request()
+    {
+        release_own_response();
+        read_expected = true;
+        if (buf && buf->next_request()) {
+            debug("parsing pipelined request");
+            request_start = now_ns();
+            trace(TRACE_REQUEST_START, (uintptr_t) this, buf->received_size);
+            set_timeout(HEADER_TIMEOUT);
+            if (!uring)
+                set_events(EV_READ);
+            parse_request();
+            return;
+        }
+        release_buffer();
+        set_timeout(IDLE_TIMEOUT);
+        set_events(EV_READ);
+    }
+
+    void report_queue_depth()
+    {
+        // report task queue high water mark each time it doubles
+        static thread_local size_t reported = 0;
+        size_t hwm = thread_pool.queue_high_water();
+        if (hwm > reported * 2) {
+            reported = hwm;
+            debug("task queue high water mark: ", hwm);
+        }
+    }
+
+    bool zerocopy()
+    {
+        // own response may be freed before kernel is done with its pages
+        return OPT_VALUE_ZEROCOPY && send_body && response->body_size() >= (size_t) OPT_VALUE_ZEROCOPY &&
+               response != own_response;
+    }
+
+    /* Start sending response right away: socket is usually writable,
+       so waiting for EV_WRITE would only cost one more loop iteration. */
+    void reply()
+    {
+        reply_start = now_ns();
+        sent_size = 0;
+        send_body = !head_request;
+        if (uring)
+            uring_send();
+        else
+            write_conn();
+    }
+
     void write_conn()
     {
-        ssize_t send_sz = send(conn_watcher.fd, RESPONSE.data() + sent_size, RESPONSE.size() - sent_size, 0);
-        sent_size += send_sz;
-        if (sent_size == RESPONSE.size()) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = response->unsent(sent_size, iov, send_body);
+        int flags = MSG_NOSIGNAL;
+        if (zerocopy())
+            flags |= MSG_ZEROCOPY;
+        ssize_t send_sz;
+        do {
+            send_sz = sendmsg(conn_watcher.fd, &msg, flags);
+            if (send_sz == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // out of optmem for pinned pages: fall back to copying this time
+                flags &= ~MSG_ZEROCOPY;
+                send_sz = sendmsg(conn_watcher.fd, &msg, flags);
+            }
+        } while (send_sz == -1 && errno == EINTR);
+        if (send_sz == -1 && errno == EAGAIN) {
+            // socket buffer is full: continue when it becomes writable
+            if (!(conn_watcher.events & EV_WRITE))
+                set_events(EV_READ | EV_WRITE);
+            return;
+        }
+        if (send_sz > 0 && (flags & MSG_ZEROCOPY))
+            zerocopy_pending = true;
+        on_write(send_sz == -1 ? -errno : send_sz);
+    }
+
+    /* Response bodies are never modified, so notifications are not waited for:
+       they are only removed from error queue, which otherwise keeps
+       the socket signalled (EPOLLERR) and grows until socket is closed. */
+    void drain_zerocopy()
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg;
+        for (;;) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(conn_watcher.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+                break;
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            if (!cm)
+                continue;
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED))
+                debug("zero-copy send was done by copying");
+        }
+        zerocopy_pending = false;
+    }
+
+    // res is sent size or negative errno
+    void on_write(ssize_t res)
+    {
+        if (res < 0) {
+            debug("send failed: ", strerror(-res));
+            finish();
+            return;
+        }
+        sent_size += res;
+        if (sent_size == response->size(send_body)) {
             debug("sent reply");
-            delete this;
+            uint64_t now = now_ns();
+            stage(STAGE_WRITE, reply_start, now);
+            metrics.local().request_latency.record(now - request_start);
+            trace(TRACE_REPLY_SENT, (uintptr_t) this, sent_size);
+            if (keep_alive)
+                next_request();
+            else
+                finish();
             return;
         }
+        // partial write: try the rest at once, it fails with EAGAIN if buffer is really full
+        if (uring)
+            uring_send();
+        else
+            write_conn();
     }
 
     static void
     conn_callback (EV_P_ ev_io *w, int revents)
     {
         ConnectionCtx *self = (ConnectionCtx *)w->data;
+        if (self->zerocopy_pending)
+            self->drain_zerocopy();
+        /* Any handler may destroy connection, so only one is called.
+           Watcher is level-triggered: pending read is reported on next iteration. */
+        if (revents & EV_WRITE) {
+            self->write_conn();
+            return;
+        }
         if (revents & EV_READ) {
             if (self->read_expected) {
                 self->read_conn();
@@ -336,45 +1009,113 @@ class ConnectionCtx : public OnPool<ConnectionCtx>
                 self->read_unexpected();
             }
         }
-        if (revents & EV_WRITE)
-            self->write_conn();
     }
 
-    static void
-    async_callback (EV_P_ ev_async *w, int revents)
+    bool can_migrate();
+    void migrate();
+    void set_blocking(bool blocking);
+    /* Passes request to coroutine of own loop (accept thread acting as worker),
+       to worker thread or to coroutine of worker loop; false if they are overloaded */
+    bool offload();
+
+    /* Called by CompletionQueue: in accept thread when offloaded task is done
+       or when connection comes back from worker loop, in worker loop when
+       connection is passed to it. */
+    virtual void completed();
+
+    void task_done()
     {
-        ConnectionCtx *self = (ConnectionCtx *)w->data;
-        self->async_task = false;
-        ev_async_stop(self->event_loop, &self->async_watcher);
-        if (self->conn_watcher.fd == 0) {
-            delete self;
+        async_task = false;
+        timers.cancel(this);
+        if (conn_watcher.fd == 0) {
+            finish();
+            return;
+        }
+        // 504 is being sent, connection is finished when it is done
+        if (task_timed_out)
             return;
+        reply();
+    }
+
+    // Arms timer for kind; zero timeout option disables it
+    void set_timeout(Timeout kind)
+    {
+        double seconds = 0;
+        switch (kind) {
+            case HEADER_TIMEOUT:
+                seconds = OPT_VALUE_HEADER_TIMEOUT;
+                break;
+            case IDLE_TIMEOUT:
+                seconds = OPT_VALUE_KEEPALIVE_TIMEOUT;
+                break;
+            case TASK_TIMEOUT:
+                seconds = OPT_VALUE_TASK_TIMEOUT / 1000.;
+                break;
         }
-        ev_io_stop(self->event_loop, &self->conn_watcher);
-        self->conn_watcher.events = EV_READ | EV_WRITE;
-        ev_io_start(self->event_loop, &self->conn_watcher);
+        timeout = kind;
+        if (seconds > 0)
+            timers.arm(this, seconds);
+        else
+            timers.cancel(this);
     }
 
+    virtual void expired();
+
 public:
-    ConnectionCtx(struct ev_loop *event_loop_, int conn_fd) :
+    ConnectionCtx(struct ev_loop *event_loop_, CompletionQueue &completions_, BufferPool &buffers_,
+                  TimerWheel &timers_, int conn_fd, URing *uring_ = nullptr) :
         event_loop{event_loop_},
-        parser(full_buf, received_size)
+        uring{uring_},
+        completions(completions_),
+        buffers(buffers_),
+        timers(timers_)
     {
+        // in libev mode conn_fd is already non-blocking (see AcceptTask::accept_conn())
         debug("ConnectionCtx created");
-        if (fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
-            throw Errno("fcntl");
-        }
+        count(CONNS_OPENED);
+        accepted_at = now_ns();
+        trace(TRACE_CONN_OPEN, (uintptr_t) this, conn_fd);
+        set_timeout(HEADER_TIMEOUT);
         ev_io_init (&conn_watcher, conn_callback, conn_fd, EV_READ);
-        ev_async_init (&async_watcher, async_callback);
         conn_watcher.data = this;
-        async_watcher.data = this;
-        ev_io_start(event_loop, &conn_watcher);
+        if (uring)
+            uring_recv();
+        else
+            ev_io_start(event_loop, &conn_watcher);
+    }
+    // Connection of another thread with parsed request (see LoopWorker::adopt())
+    ConnectionCtx(struct ev_loop *event_loop_, CompletionQueue &completions_, BufferPool &buffers_,
+                  TimerWheel &timers_, const ConnectionCtx &from, LoopWorker *worker) :
+        ConnectionCtx(event_loop_, completions_, buffers_, timers_, from.conn_watcher.fd)
+    {
+        timers.cancel(this);
+        read_expected = false;
+        keep_alive = from.keep_alive;
+        head_request = from.head_request;
+        service = from.service;
+        response = from.response;
+        zerocopy_pending = from.zerocopy_pending;
+        accepted_at = 0;
+        request_start = from.request_start;
+        home = ADOPTED;
+        loop_worker = worker;
     }
     ConnectionCtx(const ConnectionCtx&) = delete;
-    ~ConnectionCtx()
+    ~ConnectionCtx();
+
+    // Worker loop is done with connection which was passed to it; must be the last call on this
+    void
+    return_home(bool adopted)
     {
-        terminate();
-        debug("ConnectionCtx destroying");
+        home = adopted ? LEFT : BOUNCED;
+        completions.push(this);
+    }
+
+    // Serve request which was parsed by another thread
+    void
+    resume_request()
+    {
+        reply();
     }
 };
 
@@ -382,7 +1123,267 @@ INIT_POOL(ConnectionCtx);
 
 using std::unique_ptr;
 
-class AcceptTask : public Task
+/* Event loop of worker thread which serves connections of MIGRATE routes.
+   Connection with parsed request is passed to it through its CompletionQueue,
+   so long or streaming responses don't hold accept thread loop. */
+class LoopWorker : public Task
+{
+    struct ev_loop *event_loop;
+    unique_ptr<Pool<ConnectionCtx>> pool;
+    unique_ptr<BufferPool> buffers;
+    unique_ptr<CompletionQueue> completions;
+    unique_ptr<TimerWheel> timers;
+    // runs coroutines of offloaded requests (see --coroutines)
+    unique_ptr<CoScheduler> scheduler;
+
+public:
+    // connections served by the loop, read by accept threads to choose the least loaded
+    std::atomic<size_t> connections{0};
+
+    LoopWorker(size_t conn_capacity, size_t buf_capacity) :
+        event_loop(ev_loop_new(EVBACKEND_EPOLL)),
+        pool(new Pool<ConnectionCtx>(conn_capacity, ENABLED_OPT(POOL_HUGEPAGES))),
+        buffers(new BufferPool(OPT_VALUE_BUFFER_SIZE, buf_capacity)),
+        completions(new CompletionQueue),
+        timers(new TimerWheel(TIMER_TICK)),
+        // sub-tasks of its coroutines, one at a time each (see SlowTask::run())
+        scheduler(new CoScheduler(*completions, OPT_VALUE_TASK_QUEUE))
+    {
+        debug("LoopWorker created");
+    }
+    LoopWorker(const LoopWorker&) = delete;
+    virtual ~LoopWorker()
+    {
+        scheduler.reset();
+        completions.reset();
+        timers.reset();
+        if (event_loop)
+            ev_loop_destroy(event_loop);
+    }
+
+    // called by accept thread
+    void
+    push(ConnectionCtx *conn)
+    {
+        completions->push(conn);
+    }
+
+    // called by accept thread; false if the loop has --task-queue coroutines already
+    bool
+    post(CoTask<> &&task)
+    {
+        return scheduler->post(std::move(task), OPT_VALUE_TASK_QUEUE);
+    }
+
+    size_t
+    load() const
+    {
+        return connections.load(std::memory_order_relaxed) + scheduler->running();
+    }
+
+    // Takes connection passed by push(); called in worker loop
+    void
+    adopt(ConnectionCtx *from)
+    {
+        if (pool->full()) {
+            error("No free connection in worker loop!");
+            from->return_home(false);
+            return;
+        }
+        ConnectionCtx *conn = new (*pool) ConnectionCtx(event_loop, *completions, *buffers, *timers, *from, this);
+        ++connections;
+        trace(TRACE_ADOPT, (uintptr_t) from, (uintptr_t) conn);
+        from->return_home(true);
+        conn->resume_request();
+    }
+
+    virtual void execute()
+    {
+        completions->attach(event_loop);
+        timers->attach(event_loop);
+        buffers->attach(event_loop);
+        scheduler->attach(event_loop);
+        debug("running worker event loop...");
+        ev_run(event_loop, 0);
+    }
+};
+
+vector<LoopWorker *> loop_workers;
+
+LoopWorker *
+least_loaded_worker()
+{
+    LoopWorker *target = loop_workers[0];
+    for (LoopWorker *w : loop_workers) {
+        if (w->load() < target->load())
+            target = w;
+    }
+    return target;
+}
+
+bool
+ConnectionCtx::can_migrate()
+{
+    /* Pipelined data and io_uring operations in flight belong to accept thread,
+       such connection is served where it is. */
+    return !loop_workers.empty() && home == AT_HOME && !buf && !(uring && uring_inflight());
+}
+
+void
+ConnectionCtx::set_blocking(bool blocking)
+{
+    int fd = conn_watcher.fd;
+    int flags = fcntl(fd, F_GETFL, 0);
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, flags) == -1)
+        throw Errno("fcntl");
+}
+
+bool
+ConnectionCtx::offload()
+{
+    /* No handoff to another thread: the work waits in this loop as coroutine,
+       so other connections of the loop are served meanwhile. */
+    if (home == AT_HOME && take_accept_worker()) {
+        if (CoScheduler::current().post(SlowTask::run_inline(SlowTask(&completions, this)), OPT_VALUE_TASK_QUEUE))
+            return true;
+        release_accept_worker();
+        return false;
+    }
+    if (ENABLED_OPT(COROUTINES))
+        return least_loaded_worker()->post(SlowTask::run(SlowTask(&completions, this)));
+    return thread_pool.emplace_task<SlowTask>(&completions, this);
+}
+
+void
+ConnectionCtx::migrate()
+{
+    LoopWorker *target = least_loaded_worker();
+    debug("migrating connection to worker loop ", target);
+    count(MIGRATED);
+    trace(TRACE_MIGRATE, (uintptr_t) this, (uintptr_t) target);
+    if (uring) {
+        // io_uring accepts blocking sockets, worker loop is libev one
+        set_blocking(false);
+        int sock_opt = 1;
+        if (OPT_VALUE_ZEROCOPY &&
+            setsockopt(conn_watcher.fd, SOL_SOCKET, SO_ZEROCOPY, (char *) &sock_opt, sizeof(sock_opt)) == -1)
+            throw Errno("setsockopt SO_ZEROCOPY");
+    } else {
+        ev_io_stop(event_loop, &conn_watcher);
+    }
+    home = LEAVING;
+    loop_worker = target;
+    target->push(this);
+}
+
+void
+ConnectionCtx::completed()
+{
+    switch (home) {
+        case LEAVING:
+            stage(STAGE_WAKEUP, pushed_at(), now_ns());
+            // in worker loop thread; this is not touched after adopt()
+            loop_worker->adopt(this);
+            return;
+        case LEFT:
+            // socket belongs to context in worker loop now
+            conn_watcher.fd = 0;
+            delete this;
+            return;
+        case BOUNCED:
+            home = AT_HOME;
+            loop_worker = nullptr;
+            if (uring)
+                set_blocking(true);
+            else
+                ev_io_start(event_loop, &conn_watcher);
+            reply();
+            return;
+        default:
+            stage(STAGE_WAKEUP, pushed_at(), now_ns());
+            trace(TRACE_TASK_DONE, (uintptr_t) this);
+            task_done();
+            return;
+    }
+}
+
+void
+ConnectionCtx::expired()
+{
+    trace(TRACE_TIMEOUT, (uintptr_t) this, timeout);
+    switch (timeout) {
+        case HEADER_TIMEOUT:
+            debug("request head is not received in time, closing connection");
+            count(HEADER_TIMEOUTS);
+            finish();
+            return;
+        case IDLE_TIMEOUT:
+            debug("keep-alive connection is idle, closing it");
+            count(IDLE_TIMEOUTS);
+            finish();
+            return;
+        case TASK_TIMEOUT:
+            /* Worker still has the task, connection lives until it is done
+               (see finish() and task_done()). */
+            debug("task deadline has passed, replying 504");
+            count(TASK_TIMEOUTS);
+            task_timed_out = true;
+            keep_alive = false;
+            response = &responses.timeout();
+            reply();
+            return;
+    }
+}
+
+ConnectionCtx::~ConnectionCtx()
+{
+    // fd is zero for connection which has left to worker loop
+    trace(TRACE_CONN_CLOSE, (uintptr_t) this, conn_watcher.fd);
+    terminate();
+    buffers.cancel(this);
+    if (provided_size)
+        uring->recycle_buffer(provided_id);
+    release_buffer();
+    release_own_response();
+    timers.cancel(this);
+    count(CONNS_CLOSED);
+    if (home == ADOPTED)
+        --loop_worker->connections;
+    debug("ConnectionCtx destroying");
+}
+
+/* Accept thread state which is used only after AcceptTask is started,
+   it is kept apart so that AcceptTask fits into TaskHolder. */
+struct AcceptState
+{
+    // gives back free pool memory each --pool-idle seconds
+    ev_timer trim_watcher;
+    // accept statistics for tuning --accept-batch
+    size_t accept_wakeups = 0;
+    size_t accepted_total = 0;
+    size_t batch_exhausted = 0;
+    // tasks done by worker threads
+    CompletionQueue completions;
+    /* Runs offloaded requests of the thread acting as worker (see --accept-workers);
+       its frames are also of coroutines posted to worker loops. */
+    CoScheduler scheduler{completions, (size_t) (OPT_VALUE_LOOP_WORKERS + 1) * OPT_VALUE_TASK_QUEUE};
+    // timeouts of connections
+    TimerWheel timers{TIMER_TICK};
+    // io_uring mode: connections accepted while pool is exhausted, before accept is cancelled
+    std::deque<int> backlog;
+    // takes connections from backlog when pool gets free chunk
+    ev_timer resume_watcher;
+    // pool exhaustion statistics
+    size_t pauses = 0;
+    // position of listen socket in SO_REUSEPORT group
+    int index = 0;
+};
+
+// CPU of each accept thread by index (see --accept-cpus), empty - not pinned
+vector<int> accept_cpus;
+
+class AcceptTask : public Task, public URingHandler, public PoolWaiter
 {
     /* Because AcceptTask is done inside event loop thread, processing must be fast enough
         to provide responsive frontend. This may be:
@@ -392,32 +1393,123 @@ class AcceptTask : public Task
        Otherwise, if longer processing is required, additional task should created and routed to worker thread. */
 
     static const int MAX_LISTEN_QUEUE = SOMAXCONN;
+    static const unsigned URING_ENTRIES = 4096;
+    // buffers provided to kernel for recv of connections without buffer, they are taken only until data is copied
+    static const unsigned URING_BUFFERS = 256;
+    static constexpr size_t URING_BUFFER_SIZE = 4096;
     int listen_fd;
-    // OPTIMIZE: addr can be shared
-    struct sockaddr_in addr;
 
     // libev entities
     struct ev_loop *event_loop;
     ev_io accept_watcher;
+    unique_ptr<AcceptState> state;
     unique_ptr<Pool<ConnectionCtx> > pool;
+    unique_ptr<BufferPool> buffers;
+    // io_uring mode: created by execute() in accept thread
+    unique_ptr<URing> uring;
+    enum URingOp {
+        OP_ACCEPT = 0,
+        OP_CANCEL
+    };
+    bool accept_armed = false;
+    // connection pool is exhausted, new connections wait in listen backlog
+    bool paused = false;
+
+    void
+    pause()
+    {
+        debug("connection pool is exhausted, accepting is paused");
+        paused = true;
+        ++state->pauses;
+        count(ACCEPT_PAUSES);
+        pool->notify(this);
+        if (uring) {
+            if (accept_armed)
+                uring->cancel(this, OP_CANCEL, this, OP_ACCEPT);
+        } else {
+            ev_io_stop(event_loop, &accept_watcher);
+        }
+    }
+
+    // Is called from destructor of connection, so new connections are not created right here
+    virtual void
+    pool_available()
+    {
+        if (uring) {
+            ev_timer_start(event_loop, &state->resume_watcher);
+            return;
+        }
+        debug("accepting is resumed");
+        paused = false;
+        ev_io_start(event_loop, &accept_watcher);
+    }
+
+    static void
+    resume_callback (EV_P_ ev_timer *w, int revents)
+    {
+        ((AcceptTask *)w->data)->uring_resume();
+    }
+
+    void
+    uring_resume()
+    {
+        std::deque<int> &backlog = state->backlog;
+        while (!backlog.empty() && !pool->full()) {
+            new (*pool) ConnectionCtx(event_loop, state->completions, *buffers, state->timers, backlog.front(), uring.get());
+            backlog.pop_front();
+            ++state->accepted_total;
+            count(ACCEPTED);
+        }
+        if (pool->full()) {
+            pool->notify(this);
+            return;
+        }
+        debug("accepting is resumed");
+        paused = false;
+        // otherwise it is rearmed when cancelled accept completes
+        if (!accept_armed)
+            uring_accept();
+    }
 
     void
+    uring_accept()
+    {
+        uring->accept(this, OP_ACCEPT, listen_fd, SOCK_CLOEXEC, true);
+        accept_armed = true;
+    }
+
+    /* Accept pending connections until backlog is drained or
+       --accept-batch limit is reached. Watcher is level-triggered,
+       so connections left in backlog will wake us on next loop iteration. */
+    size_t
     accept_conn()
     {
-        debug("AcceptTask incoming connection!");
-        struct sockaddr_in peer_addr;
-        socklen_t addr_len = sizeof (peer_addr);
-        int conn_fd = accept(listen_fd, (sockaddr *)&peer_addr, &addr_len);
-        if (conn_fd == -1) {
-            if (errno != EAGAIN) {
-                throw Errno("accept");
+        size_t accepted = 0;
+        while (accepted < (size_t) OPT_VALUE_ACCEPT_BATCH) {
+            if (pool->full()) {
+                pause();
+                break;
             }
-            // something ugly happened: we should get valid conn_fd here (because of read event)
-            error("Warning: unexpected EAGAIN!");
-            return;
+            int conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (conn_fd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == ECONNABORTED || errno == EINTR)
+                    continue;
+                throw Errno("accept4");
+            }
+            new (*pool) ConnectionCtx(event_loop, state->completions, *buffers, state->timers, conn_fd);
+            ++accepted;
         }
-        debug("got connection!");
-        new (*pool) ConnectionCtx(event_loop, conn_fd);
+        ++state->accept_wakeups;
+        state->accepted_total += accepted;
+        count(ACCEPTED, accepted);
+        if (accepted == (size_t) OPT_VALUE_ACCEPT_BATCH)
+            ++state->batch_exhausted;
+        debug("accepted ", accepted, " connections; "
+              "average per wakeup: ", (double) state->accepted_total / state->accept_wakeups, "; "
+              "batch exhausted ", state->batch_exhausted, " of ", state->accept_wakeups, " wakeups");
+        return accepted;
     }
 
     static void
@@ -426,17 +1518,77 @@ class AcceptTask : public Task
         ((AcceptTask *)w->data)->accept_conn();
     }
 
+    // io_uring mode: one multishot accept produces completion per connection
+    virtual void complete(int op, int res, unsigned flags)
+    {
+        if (op == OP_CANCEL)
+            return;
+        if (res >= 0) {
+            if (paused || pool->full()) {
+                // completed before cancel of accept took effect
+                state->backlog.push_back(res);
+            } else {
+                new (*pool) ConnectionCtx(event_loop, state->completions, *buffers, state->timers, res, uring.get());
+                ++state->accepted_total;
+                count(ACCEPTED);
+            }
+        } else if (res != -EAGAIN && res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+            errno = -res;
+            throw Errno("io_uring accept");
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            accept_armed = false;
+            if (!paused) {
+                debug("rearming multishot accept after ", state->accepted_total, " connections");
+                uring_accept();
+            }
+        }
+        if (!paused && pool->full())
+            pause();
+    }
+
+    static void
+    trim_callback (EV_P_ ev_timer *w, int revents)
+    {
+        ((AcceptTask *)w->data)->trim();
+    }
+
+    void
+    trim()
+    {
+        pool->trim();
+        buffers->trim();
+        debug("connections: ", pool->size(), " of ", pool->max_size(), ", ",
+              pool->committed_size() / 1024, " kb committed; "
+              "buffers: ", buffers->size(), " of ", buffers->max_size(), ", ",
+              buffers->committed_size() / 1024, " kb committed; "
+              "accepting paused ", state->pauses, " times; "
+              "worker completions: ", state->completions.completed(), " in ", state->completions.wakeups(), " wakeups; "
+              "threads: ", thread_pool.thread_count(), " (spawned ", thread_pool.spawned(),
+              ", retired ", thread_pool.retired(), ")");
+    }
+
 public:
     static size_t
     pool_size(size_t capacity)
     {
-        decltype(pool)::element_type::memsize(capacity);
+        return decltype(pool)::element_type::memsize(capacity, ENABLED_OPT(POOL_HUGEPAGES));
+    }
+
+    static size_t
+    buffer_pool_size(size_t capacity)
+    {
+        return BufferPool::memsize(capacity);
     }
 
-    AcceptTask(size_t conn_capacity) :
-        pool(new Pool<ConnectionCtx>(conn_capacity))
+    // accept tasks must be created in order of index, it is their order in SO_REUSEPORT group
+    AcceptTask(size_t conn_capacity, size_t buf_capacity, int index) :
+        state(new AcceptState),
+        pool(new Pool<ConnectionCtx>(conn_capacity, ENABLED_OPT(POOL_HUGEPAGES))),
+        buffers(new BufferPool(OPT_VALUE_BUFFER_SIZE, buf_capacity))
     {
         debug("AcceptTask created");
+        state->index = index;
         // listen socket setup
         listen_fd = socket(AF_INET, SOCK_STREAM, 0);
         if (listen_fd == -1) {
@@ -448,18 +1600,29 @@ public:
         if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (char *) &sock_opt, sizeof(sock_opt)) == -1) {
             throw Errno("setsockopt");
         }
+        struct sockaddr_in addr;
         addr.sin_family = AF_INET;
         addr.sin_addr.s_addr = INADDR_ANY;
         addr.sin_port = htons(OPT_VALUE_PORT);
         if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
             throw Errno("bind");;
         }
-        if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        // io_uring waits for connections itself, non-blocking socket is needed only for libev
+        if (!ENABLED_OPT(IO_URING) &&
+            fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
             throw Errno("fcntl");
         }
+        // zero-copy sending is enabled per socket; accepted sockets inherit it from listen socket
+        if (OPT_VALUE_ZEROCOPY && !ENABLED_OPT(IO_URING) &&
+            setsockopt(listen_fd, SOL_SOCKET, SO_ZEROCOPY, (char *) &sock_opt, sizeof(sock_opt)) == -1) {
+            throw Errno("setsockopt SO_ZEROCOPY");
+        }
         if (listen(listen_fd, MAX_LISTEN_QUEUE) != 0) {
             throw Errno("listen");
         }
+        // program belongs to the whole group, the first socket sets it
+        if (ENABLED_OPT(REUSEPORT_CPU) && index == 0)
+            attach_reuseport_cpu(listen_fd, accept_cpus, OPT_VALUE_ACCEPT_THREADS);
         // libev setup
         event_loop = ev_loop_new(EVBACKEND_EPOLL);
         ev_io_init (&accept_watcher, accept_callback, listen_fd, EV_READ);
@@ -467,15 +1630,20 @@ public:
     }
     virtual ~AcceptTask()
     {
+        uring.reset();
+        // watchers of state are stopped before their loop is destroyed
+        state.reset();
         if (event_loop)
             ev_loop_destroy(event_loop);
     }
     AcceptTask(AcceptTask &&src) :
         listen_fd{src.listen_fd},
-        addr{src.addr},
         event_loop{src.event_loop},
         accept_watcher{src.accept_watcher},
-        pool(std::move(src.pool))
+        state(std::move(src.state)),
+        pool(std::move(src.pool)),
+        buffers(std::move(src.buffers)),
+        uring(std::move(src.uring))
     {
         debug("AcceptTask moved from ", &src);
         accept_watcher.data = this;
@@ -484,15 +1652,33 @@ public:
     }
     virtual void execute()
     {
-        ev_io_start(event_loop, &accept_watcher);
-        socklen_t addr_len = sizeof(addr);
-        int conn_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_len);
-        if (conn_fd == -1) {
-            if (errno != EAGAIN) {
-                throw Errno("accept");
-            }
+        if (!accept_cpus.empty()) {
+            int cpu = accept_cpus[state->index % accept_cpus.size()];
+            debug("accept thread ", state->index, " runs on CPU ", cpu);
+            pin_thread(pthread_self(), {cpu});
+        }
+        // connections arm timers as soon as they are accepted
+        state->timers.attach(event_loop);
+        buffers->attach(event_loop);
+        if (ENABLED_OPT(IO_URING)) {
+            uring.reset(new URing(URING_ENTRIES));
+            uring->attach(event_loop);
+            // provided buffer must fit into connection buffer
+            uring->provide_buffers(URING_BUFFERS, std::min<size_t>(URING_BUFFER_SIZE, OPT_VALUE_BUFFER_SIZE));
+            uring_accept();
         } else {
-            ev_invoke(event_loop, &accept_watcher, EV_READ);
+            ev_io_start(event_loop, &accept_watcher);
+            // connections could come before event loop is started
+            accept_conn();
+        }
+        state->completions.attach(event_loop);
+        state->scheduler.attach(event_loop);
+        ev_timer_init (&state->resume_watcher, resume_callback, 0., 0.);
+        state->resume_watcher.data = this;
+        if (OPT_VALUE_POOL_IDLE) {
+            ev_timer_init (&state->trim_watcher, trim_callback, OPT_VALUE_POOL_IDLE, OPT_VALUE_POOL_IDLE);
+            state->trim_watcher.data = this;
+            ev_timer_start(event_loop, &state->trim_watcher);
         }
         debug("running event loop...");
         ev_run(event_loop, 0);
@@ -513,6 +1699,24 @@ daemonize()
         throw Errno("daemon");
 }
 
+/* Each ring buffer in use takes one mapping (see RingSlab), buffers of all
+   pools together must stay within vm.max_map_count; part of it is left for
+   other mappings of the process. Returns capacity per pool which fits. */
+long
+fit_buffer_capacity(long capacity, long pools)
+{
+    FILE *file = fopen("/proc/sys/vm/max_map_count", "r");
+    if (!file)
+        return capacity;
+    long max_count;
+    int scanned = fscanf(file, "%ld", &max_count);
+    fclose(file);
+    if (scanned != 1)
+        return capacity;
+    long fit = (max_count - max_count / 8) / pools;
+    return std::max(std::min(capacity, fit), 1L);
+}
+
 int
 main(int argc, char ** argv)
 {
@@ -523,32 +1727,97 @@ main(int argc, char ** argv)
         return res;
     }
 
+    cdebug("main", "request scanner: ", scanner.name());
+
+    vector<int> worker_cpus;
+    try {
+        if (HAVE_OPT(ACCEPT_CPUS))
+            accept_cpus = parse_cpu_list(OPT_ARG(ACCEPT_CPUS));
+        else if (HAVE_OPT(NIC_QUEUES)) {
+            accept_cpus = nic_queue_cpus(OPT_ARG(NIC_QUEUES));
+            if (accept_cpus.empty())
+                cerror("main", "No queue interrupts of ", OPT_ARG(NIC_QUEUES), " are found, accept threads are not pinned");
+        }
+        if (HAVE_OPT(WORKER_CPUS))
+            worker_cpus = parse_cpu_list(OPT_ARG(WORKER_CPUS));
+    } catch(std::exception &ex) {
+        std::cerr << ex.what() << "\n";
+        return 100;
+    }
+
+    // one accept thread per CPU of the list
     if (!HAVE_OPT(ACCEPT_THREADS))
-        OPT_VALUE_ACCEPT_THREADS = std::thread::hardware_concurrency();
+        OPT_VALUE_ACCEPT_THREADS = accept_cpus.empty() ? std::thread::hardware_concurrency() : accept_cpus.size();
 
     if (!HAVE_OPT(WORKER_THREADS))
         OPT_VALUE_WORKER_THREADS = OPT_VALUE_ACCEPT_THREADS;
 
+    if (ENABLED_OPT(COROUTINES) && OPT_VALUE_LOOP_WORKERS == 0) {
+        cerror("main", "--coroutines needs worker loops (--loop-workers)");
+        return 100;
+    }
+
+    // accept threads and worker loops have buffer pool each
+    long buffer_pools = OPT_VALUE_ACCEPT_THREADS + OPT_VALUE_LOOP_WORKERS;
+    long buffer_capacity = fit_buffer_capacity(OPT_VALUE_BUFFER_CAPACITY, buffer_pools);
+    if (buffer_capacity < OPT_VALUE_BUFFER_CAPACITY) {
+        cerror("main", "--buffer-capacity ", OPT_VALUE_BUFFER_CAPACITY, " for ", buffer_pools,
+               " threads exceeds vm.max_map_count, it is lowered to ", buffer_capacity);
+        OPT_VALUE_BUFFER_CAPACITY = buffer_capacity;
+    }
+
+    if (OPT_VALUE_ACCEPT_WORKERS > OPT_VALUE_ACCEPT_THREADS)
+        OPT_VALUE_ACCEPT_WORKERS = OPT_VALUE_ACCEPT_THREADS;
+
     // main thread is also accept thread, thus decreasing spawning
     int accept_pool_sz = OPT_VALUE_ACCEPT_THREADS - 1;
 
+    // pre-serialized responses are shared by all accept threads
+    const std::string body(OPT_VALUE_BODY_SIZE, 'x');
+    for (unsigned service = NOT_DEFINED + 1; service < SERVICE_COUNT; ++service)
+        responses.set_route(service, 200, body);
+
+    // path is relative to the starting directory, daemonize() changes it
+    if (HAVE_OPT(TRACE))
+        tracer.open(OPT_ARG(TRACE), OPT_VALUE_TRACE_RING);
+
     if (ENABLED_OPT(DAEMONIZE))
         daemonize();
 
-    thread_pool.spawn_threads(accept_pool_sz + OPT_VALUE_WORKER_THREADS);
+    if (HAVE_OPT(TRACE))
+        tracer.start();
 
+    thread_pool.pin_threads(worker_cpus);
+    thread_pool.spawn_threads(OPT_VALUE_WORKER_THREADS, OPT_VALUE_TASK_QUEUE, ENABLED_OPT(WORK_STEALING));
+
+    size_t conn_pool_sz = AcceptTask::pool_size(OPT_VALUE_ACCEPT_CAPACITY);
+    size_t buf_pool_sz = AcceptTask::buffer_pool_size(OPT_VALUE_BUFFER_CAPACITY);
     cdebug("main", "Running ", OPT_VALUE_ACCEPT_THREADS, " "
-           "accept threads; pool size: ", AcceptTask::pool_size(OPT_VALUE_ACCEPT_CAPACITY) / 1024, " kb; "
-           "total pool size: ", AcceptTask::pool_size(OPT_VALUE_ACCEPT_CAPACITY) * OPT_VALUE_ACCEPT_THREADS / 1024, " kb.");
+           "accept threads; connection pool size: ", conn_pool_sz / 1024, " kb; "
+           "buffer pool size: ", buf_pool_sz / 1024, " kb "
+           "(and ", RingSlab::memsize(OPT_VALUE_BUFFER_SIZE, OPT_VALUE_BUFFER_CAPACITY) / 1024, " kb of ring address space); "
+           "total pool size: ", (conn_pool_sz + buf_pool_sz) * OPT_VALUE_ACCEPT_THREADS / 1024, " kb.");
 
     try
     {
-        for (int i = 0; i < accept_pool_sz; ++i) {
-            AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY);
-            thread_pool.add_task(accept_task);
+        // event loops never end, they run on threads of their own
+        for (int i = 0; i < OPT_VALUE_LOOP_WORKERS; ++i) {
+            loop_workers.push_back(thread_pool.start_task<LoopWorker>(OPT_VALUE_ACCEPT_CAPACITY,
+                                                                      OPT_VALUE_BUFFER_CAPACITY));
         }
 
-        AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY);
+        for (int i = 0; i < accept_pool_sz; ++i)
+            thread_pool.start_task<AcceptTask>(OPT_VALUE_ACCEPT_CAPACITY, OPT_VALUE_BUFFER_CAPACITY, i);
+
+        SizingPolicy sizing;
+        sizing.free_threshold = OPT_VALUE_FREE_THRESHOLD;
+        sizing.spawn_hunk = OPT_VALUE_SPAWN_HUNK;
+        sizing.spawn_factor = OPT_VALUE_SPAWN_FACTOR;
+        sizing.thread_limit = OPT_VALUE_WORKER_LIMIT;
+        sizing.idle_timeout = std::chrono::seconds(OPT_VALUE_WORKER_IDLE);
+        thread_pool.adapt(sizing, accept_pool_sz + OPT_VALUE_LOOP_WORKERS);
+
+        AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY, OPT_VALUE_BUFFER_CAPACITY, accept_pool_sz);
         accept_task.execute();
     } catch(std::bad_alloc &) {
         std::cerr << "Not enough memory!\n";
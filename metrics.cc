@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdarg>
+#include "metrics.h"
+
+Metrics metrics;
+
+static const char *STAGE_NAMES[STAGE_COUNT] = {"accept", "read", "queue", "execute", "wakeup", "write"};
+
+// printf to the end of out; string keeps its memory between reports
+static void
+appendf(std::string &out, const char *format, ...)
+{
+    char chunk[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(chunk, sizeof(chunk), format, args);
+    va_end(args);
+    if (len > 0)
+        out.append(chunk, std::min<size_t>(len, sizeof(chunk) - 1));
+}
+
+static void
+json_latency(std::string &out, const char *name, const Histogram &h)
+{
+    appendf(out, "\"%s\": {\"count\": %llu, \"mean\": %g, \"p50\": %g, \"p90\": %g, \"p99\": %g, "
+            "\"p99.9\": %g, \"max\": %g}", name, (unsigned long long) h.count(), h.mean() / 1e3,
+            h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+            h.percentile(99.9) / 1e3, h.max() / 1e3);
+}
+
+void
+Metrics::report(std::string &out, size_t queue_high_water)
+{
+    uint64_t sums[METRIC_COUNT] = {};
+    Histogram request_latency, stages[STAGE_COUNT];
+    threads_.for_each([&](ThreadMetrics &thread, size_t) {
+        for (int m = 0; m < METRIC_COUNT; ++m)
+            sums[m] += thread.counters[m].get();
+        thread.request_latency.read(request_latency);
+        for (int s = 0; s < STAGE_COUNT; ++s)
+            thread.stages[s].read(stages[s]);
+    });
+    // counters of different threads are read at different moments, differences may be off a bit
+    auto diff = [](uint64_t a, uint64_t b) { return (unsigned long long) (a > b ? a - b : 0); };
+    out.clear();
+    appendf(out, "{\"accepted\": %llu, \"parse_failures\": %llu, \"requests\": %llu, \"offloaded\": %llu, "
+            "\"rejected\": %llu, \"migrated\": %llu, \"accept_pauses\": %llu, ",
+            (unsigned long long) sums[ACCEPTED], (unsigned long long) sums[PARSE_FAILURES],
+            (unsigned long long) sums[REQUESTS], (unsigned long long) sums[OFFLOADED],
+            (unsigned long long) sums[REJECTED], (unsigned long long) sums[MIGRATED],
+            (unsigned long long) sums[ACCEPT_PAUSES]);
+    appendf(out, "\"timeouts\": {\"header\": %llu, \"idle\": %llu, \"task\": %llu}, ",
+            (unsigned long long) sums[HEADER_TIMEOUTS], (unsigned long long) sums[IDLE_TIMEOUTS],
+            (unsigned long long) sums[TASK_TIMEOUTS]);
+    appendf(out, "\"connections\": %llu, \"buffers\": %llu, \"task_queue\": %llu, \"task_queue_high_water\": %zu, ",
+            diff(sums[CONNS_OPENED], sums[CONNS_CLOSED]), diff(sums[BUFFERS_LEASED], sums[BUFFERS_RELEASED]),
+            diff(sums[OFFLOADED], sums[TASKS_STARTED]), queue_high_water);
+    json_latency(out, "request_latency_us", request_latency);
+    out += ", \"stages_us\": {";
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        if (s)
+            out += ", ";
+        json_latency(out, STAGE_NAMES[s], stages[s]);
+    }
+    out += "}, \"threads\": [";
+    // per-thread values are read once more, they may be a bit ahead of sums
+    size_t thread_count = 0;
+    threads_.for_each([&](ThreadMetrics &thread, size_t) {
+        int64_t connections = thread.counters[CONNS_OPENED].get() - thread.counters[CONNS_CLOSED].get();
+        appendf(out, "%s{\"requests\": %llu, \"connections\": %lld}", thread_count++ ? ", " : "",
+                (unsigned long long) thread.counters[REQUESTS].get(), (long long) connections);
+    });
+    out += "]}\n";
+}
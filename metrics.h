@@ -0,0 +1,159 @@
+#ifndef __cd_metrics_h
+#define __cd_metrics_h
+
+#include <atomic>
+#include <string>
+#include <time.h>
+#include "thread_slots.h"
+#include "histogram.h"
+
+/* Statistics of server threads. Each thread writes only its own
+   ThreadMetrics, so updates are plain loads and stores without locked
+   instructions or shared cache lines. Values of all threads are summed
+   only when they are read (Metrics::report()), readers take no locks. */
+
+enum Metric {
+    ACCEPTED = 0,
+    // requests finished by parser with error (bad or too large request)
+    PARSE_FAILURES,
+    REQUESTS,
+    OFFLOADED,
+    // replied 503 because task queue was full
+    REJECTED,
+    MIGRATED,
+    // connection and buffer pools occupancy is opened minus closed
+    CONNS_OPENED,
+    CONNS_CLOSED,
+    BUFFERS_LEASED,
+    BUFFERS_RELEASED,
+    // task queue depth is offloaded minus started
+    TASKS_STARTED,
+    ACCEPT_PAUSES,
+    // connections closed for timeout of request head or keep-alive
+    HEADER_TIMEOUTS,
+    IDLE_TIMEOUTS,
+    // replied 504 because offloaded task was not done in time
+    TASK_TIMEOUTS,
+    METRIC_COUNT
+};
+
+/* Stages of request life, the durations are kept in per-thread histograms.
+   Stages of one request may be recorded by different threads. */
+enum Stage {
+    // connection accepted -> first byte of its first request
+    STAGE_ACCEPT = 0,
+    // first byte of request -> request head parsed
+    STAGE_READ,
+    // offloaded task enqueued -> taken by worker thread
+    STAGE_QUEUE,
+    // offloaded work done by worker or accept thread
+    STAGE_EXECUTE,
+    // completion pushed by another thread -> taken by event loop
+    STAGE_WAKEUP,
+    // reply started -> last byte sent, includes waiting for writable socket
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+
+// Counter of one writer thread
+class Counter
+{
+    std::atomic<uint64_t> value_{0};
+
+public:
+    void
+    add(uint64_t n = 1)
+    {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    get() const
+    {
+        return value_.load(std::memory_order_relaxed);
+    }
+};
+
+// Histogram of one writer thread which may be read by any thread
+class SharedHistogram
+{
+    std::atomic<uint64_t> counts_[Histogram::BUCKETS];
+
+public:
+    SharedHistogram()
+    {
+        for (auto &c: counts_)
+            c.store(0, std::memory_order_relaxed);
+    }
+
+    void
+    record(uint64_t value)
+    {
+        std::atomic<uint64_t> &c = counts_[Histogram::index(value)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Adds counts to histogram; values are taken as highest of their buckets
+    void
+    read(Histogram &into) const
+    {
+        for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+            uint64_t n = counts_[i].load(std::memory_order_relaxed);
+            if (n)
+                into.record(Histogram::bucket_value(i), n);
+        }
+    }
+};
+
+struct ThreadMetrics
+{
+    Counter counters[METRIC_COUNT];
+    // nanoseconds from first byte of request to last byte of reply
+    SharedHistogram request_latency;
+    // nanoseconds of each stage
+    SharedHistogram stages[STAGE_COUNT];
+};
+
+class Metrics
+{
+    // block of exited thread is taken by next new thread, counts are kept
+    ThreadSlots<ThreadMetrics> threads_;
+
+public:
+    // metrics of calling thread
+    ThreadMetrics &
+    local()
+    {
+        return threads_.local();
+    }
+
+    /* Writes JSON with sums of all threads to out, reusing its memory;
+       queue_high_water is taken from thread pool */
+    void report(std::string &out, size_t queue_high_water);
+};
+
+extern Metrics metrics;
+
+inline void
+count(Metric m, uint64_t n = 1)
+{
+    metrics.local().counters[m].add(n);
+}
+
+// monotonic time for latency metrics
+inline uint64_t
+now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// records stage which started at start and ended at end
+inline void
+stage(Stage s, uint64_t start, uint64_t end)
+{
+    metrics.local().stages[s].record(end - start);
+}
+
+#endif // __cd_metrics_h
@@ -0,0 +1,466 @@
+#include <cstring>
+#include <strings.h>
+#include <cassert>
+#include "main_opts.h"
+#include "parser.h"
+#include "util.h"
+
+const Scanner scanner;
+
+static const struct {
+    const char *name;
+    size_t size;
+} METHODS[] = {
+    {"", 0},
+    {"GET", 3},
+    {"HEAD", 4},
+    {"POST", 4},
+    {"PUT", 3},
+    {"DELETE", 6},
+    {"CONNECT", 7},
+    {"OPTIONS", 7},
+    {"TRACE", 5},
+    {"PATCH", 5}
+};
+static const size_t MAX_METHOD = 7;
+
+static const char HTTP_1_1[] = "HTTP/1.1";
+static const char HDR_CONNECTION[] = "Connection";
+static const char HDR_CONTENT_LENGTH[] = "Content-Length";
+static const char HDR_TRANSFER_ENCODING[] = "Transfer-Encoding";
+static const char CONN_CLOSE[] = "close";
+static const char CONN_KEEP_ALIVE[] = "keep-alive";
+static const char TE_CHUNKED[] = "chunked";
+
+// s2 is a literal
+template <size_t N>
+static inline bool
+equal(const char *s1, size_t s1_size, const char (&s2)[N])
+{
+    return s1_size == N - 1 && 0 == memcmp(s1, s2, N - 1);
+}
+
+template <size_t N>
+static inline bool
+iequal(const char *s1, size_t s1_size, const char (&s2)[N])
+{
+    return s1_size == N - 1 && 0 == strncasecmp(s1, s2, N - 1);
+}
+
+static inline bool
+is_ows(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* Call f(token, size) for each element of comma-separated list,
+   stops when f returns false. Empty elements are skipped. */
+template <class F>
+static bool
+for_each_token(const char *value, size_t value_size, F f)
+{
+    const char *end = value + value_size;
+    while (value < end) {
+        const char *comma = (const char *) memchr(value, ',', end - value);
+        const char *token_end = comma ? comma : end;
+        while (value < token_end && is_ows(*value))
+            ++value;
+        const char *last = token_end;
+        while (last > value && is_ows(last[-1]))
+            --last;
+        if (last > value && !f(value, last - value))
+            return false;
+        value = token_end + 1;
+    }
+    return true;
+}
+
+ReqParser::ReqParser(char *full_buf_, size_t buf_size_, size_t &received_size_) :
+    parse{&ReqParser::check_method},
+    full_buf{full_buf_},
+    buf_size{buf_size_},
+    received_size{received_size_}
+{
+}
+
+void
+ReqParser::reset(char *full_buf_)
+{
+    full_buf = full_buf_;
+    parse = &ReqParser::check_method;
+    scan_pos = 0;
+    lines_done = 0;
+    index.reset();
+    conn_close = false;
+    chunk_state = CHUNK_SIZE;
+    chunk_pos = 0;
+    chunk_left = 0;
+    chunk_digits = 0;
+    method = UNKNOWN_METHOD;
+    requestline_size = 0;
+    uri_start = 0;
+    uri_size = 0;
+    path_size = 0;
+    header_count = 0;
+    head_size = 0;
+    content_length = 0;
+    has_content_length = false;
+    chunked = false;
+    body_size = 0;
+    request_size = 0;
+    service = NOT_DEFINED;
+    keep_alive = false;
+}
+
+const char *
+ReqParser::method_name(Method method)
+{
+    return METHODS[method].name;
+}
+
+const HeaderSpan *
+ReqParser::find_header(const char *name, size_t name_size) const
+{
+    for (size_t i = 0; i < header_count; ++i) {
+        const HeaderSpan &h = headers[i];
+        if (h.name_size == name_size && 0 == strncasecmp(&full_buf[h.name], name, name_size))
+            return &h;
+    }
+    return nullptr;
+}
+
+bool
+ReqParser::match_uri()
+{
+    // method is already checked, so the first space ends it
+    assert(index.spaces && index.sp[0] < requestline_size);
+    size_t sp = 0;
+    uri_start = index.sp[0] + 1;
+    while (++sp < index.spaces && index.sp[sp] == uri_start)
+        ++uri_start;
+    if (uri_start >= requestline_size)
+        return false;
+    size_t uri_end = sp < index.spaces ? index.sp[sp] : requestline_size;
+    uri_size = uri_end - uri_start;
+    const char *query = (const char *) memchr(&full_buf[uri_start], '?', uri_size);
+    path_size = query ? query - &full_buf[uri_start] : uri_size;
+
+    service = ROUTER.find(&full_buf[uri_start], path_size);
+    if (service == NOT_DEFINED)
+        return false;
+    match_version(sp);
+    return true;
+}
+
+// sp: index of space ending URI
+void
+ReqParser::match_version(size_t sp)
+{
+    // HTTP/1.1 connections are persistent by default, anything older is not
+    size_t version_start = uri_start + uri_size;
+    while (sp < index.spaces && index.sp[sp] == version_start) {
+        ++sp;
+        ++version_start;
+    }
+    if (version_start > requestline_size)
+        version_start = requestline_size;
+    keep_alive = equal(&full_buf[version_start], requestline_size - version_start, HTTP_1_1);
+}
+
+bool
+ReqParser::match_connection(const char *value, size_t value_size)
+{
+    for_each_token(value, value_size, [this](const char *token, size_t size) {
+        if (iequal(token, size, CONN_CLOSE))
+            conn_close = true;
+        else if (iequal(token, size, CONN_KEEP_ALIVE))
+            keep_alive = true;
+        return true;
+    });
+    if (conn_close)
+        keep_alive = false;
+    return true;
+}
+
+bool
+ReqParser::match_content_length(const char *value, size_t value_size)
+{
+    // 19 digits never overflow
+    if (value_size == 0 || value_size > 19)
+        return false;
+    size_t length = 0;
+    for (size_t i = 0; i < value_size; ++i) {
+        if (value[i] < '0' || value[i] > '9')
+            return false;
+        length = length * 10 + (value[i] - '0');
+    }
+    // repeated field must have the same value
+    if (has_content_length && length != content_length)
+        return false;
+    content_length = length;
+    has_content_length = true;
+    return true;
+}
+
+bool
+ReqParser::match_transfer_encoding(const char *value, size_t value_size)
+{
+    // body length is known only if chunked is the final coding
+    bool last_chunked = false;
+    for_each_token(value, value_size, [&last_chunked](const char *token, size_t size) {
+        last_chunked = iequal(token, size, TE_CHUNKED);
+        return true;
+    });
+    chunked = last_chunked;
+    return chunked;
+}
+
+bool
+ReqParser::match_header(size_t line, size_t line_end)
+{
+    const char *name = &full_buf[line];
+    size_t line_size = line_end - line;
+    // obsolete line folding is not accepted (RFC 7230, 3.2.4)
+    if (line_size == 0 || is_ows(name[0]))
+        return false;
+    const char *colon = (const char *) memchr(name, ':', line_size);
+    if (!colon || colon == name || is_ows(colon[-1]))
+        return false;
+    size_t name_size = colon - name;
+    const char *value = colon + 1;
+    const char *value_end = &full_buf[line_end];
+    while (value < value_end && is_ows(*value))
+        ++value;
+    while (value_end > value && is_ows(value_end[-1]))
+        --value_end;
+    size_t value_size = value_end - value;
+
+    if (header_count == MAX_HEADERS)
+        return false;
+    HeaderSpan &h = headers[header_count++];
+    h.name = line;
+    h.name_size = name_size;
+    h.value = value - full_buf;
+    h.value_size = value_size;
+
+    if (iequal(name, name_size, HDR_CONNECTION))
+        return match_connection(value, value_size);
+    if (iequal(name, name_size, HDR_CONTENT_LENGTH))
+        return match_content_length(value, value_size);
+    if (iequal(name, name_size, HDR_TRANSFER_ENCODING))
+        return match_transfer_encoding(value, value_size);
+    return true;
+}
+
+ReqParser::Status
+ReqParser::check_method()
+{
+    // method is upper case token, garbage is rejected as soon as possible
+    size_t i = 0;
+    for (; i < received_size && i <= MAX_METHOD; ++i) {
+        char c = full_buf[i];
+        if (c == ' ')
+            break;
+        if (c < 'A' || c > 'Z') {
+            debug("wrong method!");
+            return TERMINATE;
+        }
+    }
+    if (i == received_size && i <= MAX_METHOD)
+        return CONTINUE;
+    for (unsigned m = GET; m <= PATCH; ++m) {
+        if (METHODS[m].size == i && 0 == memcmp(full_buf, METHODS[m].name, i)) {
+            method = (Method) m;
+            parse = &ReqParser::find_end;
+            return find_end();
+        }
+    }
+    debug("wrong method!");
+    return TERMINATE;
+}
+
+ReqParser::Status
+ReqParser::find_end()
+{
+    size_t scan_end = received_size < MAX_HEAD_SIZE ? received_size : MAX_HEAD_SIZE;
+    scan_pos = scanner(full_buf, scan_pos, scan_end, index);
+    for (; lines_done < index.lines; ++lines_done) {
+        size_t line = index.line_start(lines_done);
+        size_t lf = index.lf[lines_done];
+        if (lf == line || full_buf[lf - 1] != '\r') {
+            debug("bare LF in request!");
+            return TERMINATE;
+        }
+        if (lines_done == 0) {
+            requestline_size = lf - 1;
+            if (!match_uri()) {
+                debug("wrong query!");
+                return TERMINATE;
+            }
+        } else if (!index.complete || lines_done + 1 < index.lines) {
+            if (!match_header(line, lf - 1)) {
+                debug("bad header field!");
+                return TERMINATE;
+            }
+        }
+    }
+    if (index.overflow) {
+        debug("too many header lines!");
+        return TERMINATE;
+    }
+    if (!index.complete) {
+        if (scan_pos == MAX_HEAD_SIZE) {
+            debug("request head is too large!");
+            return TERMINATE;
+        }
+        return CONTINUE;
+    }
+
+    head_size = index.lf[index.lines - 1] + 1;
+    if (chunked) {
+        // message with both is a request smuggling attempt (RFC 7230, 3.3.3)
+        if (has_content_length) {
+            debug("both Content-Length and chunked Transfer-Encoding!");
+            return TERMINATE;
+        }
+        chunk_pos = head_size;
+        parse = &ReqParser::read_chunked;
+        return read_chunked();
+    }
+    if (content_length) {
+        if (content_length > buf_size - head_size) {
+            debug("request body is too large: ", content_length);
+            return TERMINATE;
+        }
+        parse = &ReqParser::read_body;
+        return read_body();
+    }
+    request_size = head_size;
+    return PROCEED;
+}
+
+ReqParser::Status
+ReqParser::read_body()
+{
+    if (received_size - head_size < content_length)
+        return CONTINUE;
+    body_size = content_length;
+    request_size = head_size + body_size;
+    return PROCEED;
+}
+
+ReqParser::Status
+ReqParser::read_chunked()
+{
+    size_t pos = chunk_pos;
+    // decoded data end, always <= pos
+    size_t out = head_size + body_size;
+    Status res = CONTINUE;
+    while (pos < received_size && res == CONTINUE) {
+        char c = full_buf[pos];
+        switch (chunk_state) {
+            case CHUNK_SIZE: {
+                int digit = c >= '0' && c <= '9' ? c - '0' :
+                            c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (digit >= 0) {
+                    // chunk must fit into buffer anyway
+                    chunk_left = chunk_left * 16 + digit;
+                    if (++chunk_digits > 8 || out + chunk_left > buf_size) {
+                        debug("chunk is too large!");
+                        return TERMINATE;
+                    }
+                } else if (chunk_digits && (c == ';' || is_ows(c))) {
+                    chunk_state = CHUNK_EXT;
+                } else if (chunk_digits && c == '\r') {
+                    chunk_state = CHUNK_SIZE_LF;
+                } else {
+                    debug("bad chunk size!");
+                    return TERMINATE;
+                }
+                ++pos;
+                break;
+            }
+            case CHUNK_EXT: {
+                // chunk extensions are ignored
+                const char *cr = (const char *) memchr(&full_buf[pos], '\r', received_size - pos);
+                if (!cr) {
+                    pos = received_size;
+                    break;
+                }
+                pos = cr - full_buf + 1;
+                chunk_state = CHUNK_SIZE_LF;
+                break;
+            }
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    debug("bad chunk size line!");
+                    return TERMINATE;
+                }
+                ++pos;
+                chunk_state = chunk_left ? CHUNK_DATA : TRAILER;
+                break;
+            case CHUNK_DATA: {
+                size_t size = received_size - pos;
+                if (size > chunk_left)
+                    size = chunk_left;
+                if (out != pos)
+                    memmove(&full_buf[out], &full_buf[pos], size);
+                out += size;
+                pos += size;
+                chunk_left -= size;
+                if (!chunk_left)
+                    chunk_state = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+            case CHUNK_DATA_LF:
+                if (c != (chunk_state == CHUNK_DATA_CR ? '\r' : '\n')) {
+                    debug("chunk data is not terminated by CRLF!");
+                    return TERMINATE;
+                }
+                ++pos;
+                if (chunk_state == CHUNK_DATA_CR) {
+                    chunk_state = CHUNK_DATA_LF;
+                } else {
+                    chunk_state = CHUNK_SIZE;
+                    chunk_digits = 0;
+                }
+                break;
+            case TRAILER:
+                // trailer fields are ignored, empty line ends the body
+                chunk_state = c == '\r' ? TRAILER_LF : TRAILER_LINE;
+                ++pos;
+                break;
+            case TRAILER_LINE: {
+                const char *lf = (const char *) memchr(&full_buf[pos], '\n', received_size - pos);
+                if (!lf) {
+                    pos = received_size;
+                    break;
+                }
+                pos = lf - full_buf + 1;
+                chunk_state = TRAILER;
+                break;
+            }
+            case TRAILER_LF:
+                if (c != '\n') {
+                    debug("bad chunked body end!");
+                    return TERMINATE;
+                }
+                ++pos;
+                res = PROCEED;
+                break;
+        }
+    }
+    // drop parsed framing: move the rest of received data to decoded body end
+    if (pos != out) {
+        memmove(&full_buf[out], &full_buf[pos], received_size - pos);
+        received_size -= pos - out;
+        pos = out;
+    }
+    chunk_pos = pos;
+    body_size = out - head_size;
+    if (res == PROCEED)
+        request_size = pos;
+    return res;
+}
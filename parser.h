@@ -0,0 +1,145 @@
+#ifndef __cd_parser_h
+#define __cd_parser_h
+
+#include <cstddef>
+#include <cstdint>
+#include "scanner.h"
+#include "router.h"
+
+// Request head scanner, the fastest one supported by CPU
+extern const Scanner scanner;
+
+// Header field: offsets in request buffer, value is without surrounding whitespace
+struct HeaderSpan
+{
+    uint16_t name;
+    uint16_t name_size;
+    uint16_t value;
+    uint16_t value_size;
+};
+
+/* Incremental HTTP/1.1 request parser. It works in place on connection
+   buffer (contiguous view of ring buffer starting at request): request line, header fields and body are kept as offsets into
+   the buffer, nothing is allocated per request. Chunked body is decoded in
+   place: data is moved over chunk framing and the rest of buffer is moved
+   down, so the decoded body is contiguous and parser shrinks received size. */
+class ReqParser
+{
+public:
+    enum Status {
+        // Terminate connection
+        TERMINATE = 0,
+        // Continue current phase
+        CONTINUE,
+        // Proceed to next phase
+        PROCEED
+    };
+
+    enum Method {
+        UNKNOWN_METHOD = 0,
+        GET,
+        HEAD,
+        POST,
+        PUT,
+        DELETE,
+        CONNECT,
+        OPTIONS,
+        TRACE,
+        PATCH
+    };
+
+    // request line and empty line take the rest of index
+    static const size_t MAX_HEADERS = HeaderIndex::MAX_LINES - 2;
+    // offsets of head are 16-bit
+    static const size_t MAX_HEAD_SIZE = UINT16_MAX;
+
+private:
+    enum ChunkState {
+        CHUNK_SIZE = 0,
+        CHUNK_EXT,
+        CHUNK_SIZE_LF,
+        CHUNK_DATA,
+        CHUNK_DATA_CR,
+        CHUNK_DATA_LF,
+        TRAILER,
+        TRAILER_LINE,
+        TRAILER_LF
+    };
+
+    typedef Status(ReqParser::*parse_f)();
+    parse_f parse;
+    char *full_buf;
+    const size_t buf_size;
+    size_t &received_size;
+    size_t scan_pos = 0;
+    // lines of index already processed
+    size_t lines_done = 0;
+    HeaderIndex index;
+    // connection: close wins over keep-alive
+    bool conn_close = false;
+
+    // chunked body: raw data is read from chunk_pos, decoded is written to body end
+    ChunkState chunk_state = CHUNK_SIZE;
+    size_t chunk_pos = 0;
+    size_t chunk_left = 0;
+    unsigned chunk_digits = 0;
+
+public:
+    Method method = UNKNOWN_METHOD;
+    size_t requestline_size = 0;
+    // request target, path is its part before query
+    size_t uri_start = 0;
+    size_t uri_size = 0;
+    size_t path_size = 0;
+    HeaderSpan headers[MAX_HEADERS];
+    size_t header_count = 0;
+    // size of request line and header including terminating CRLFCRLF
+    size_t head_size = 0;
+    size_t content_length = 0;
+    bool has_content_length = false;
+    bool chunked = false;
+    // body follows head (valid after PROCEED)
+    size_t body_size = 0;
+    // size of whole request (valid after PROCEED)
+    size_t request_size = 0;
+    Service service = NOT_DEFINED;
+    bool keep_alive = false;
+
+private:
+    bool match_uri();
+    void match_version(size_t sp);
+    bool match_header(size_t line, size_t line_end);
+    bool match_connection(const char *value, size_t value_size);
+    bool match_content_length(const char *value, size_t value_size);
+    bool match_transfer_encoding(const char *value, size_t value_size);
+
+    Status check_method();
+    Status find_end();
+    Status read_body();
+    Status read_chunked();
+
+public:
+    ReqParser(char *full_buf_, size_t buf_size_, size_t &received_size_);
+
+    // Re-arm parser for next request on the same connection, it starts at full_buf_
+    void reset(char *full_buf_);
+
+    Status
+    operator()()
+    {
+        return (this->*parse)();
+    }
+
+    static const char *method_name(Method method);
+
+    // case-insensitive search of header field
+    const HeaderSpan *find_header(const char *name, size_t name_size) const;
+
+    const char *
+    body() const
+    {
+        return &full_buf[head_size];
+    }
+};
+
+#endif // __cd_parser_h
@@ -3,54 +3,237 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <new>
 #include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
 
-using std::vector;
+// Is called once when released chunk makes exhausted pool available again
+class PoolWaiter
+{
+public:
+    virtual void pool_available() = 0;
+};
 
+/* Pool of objects of one thread, it grows and shrinks by slabs up to
+   hard limit of capacity. Address space for all slabs is reserved at once,
+   but memory is committed by kernel on first touch only. Objects are taken
+   from the lowest slab having free chunk, so the upper slabs get free when
+   load falls; slab which stays free for whole period between two trim()
+   calls is given back to system. Memory is allocated on NUMA node of the
+   thread which uses pool (accept thread), not the one which created it.
+   Free chunks are linked into freelist of their slab through own memory. */
 template <class Object>
 class Pool
 {
 public:
     struct Chunk
     {
-        char data[sizeof(Object)];
+        alignas(Object) char data[sizeof(Object)];
     };
+    static_assert(sizeof(Chunk) >= sizeof(size_t), "freelist link does not fit into chunk");
 
 private:
-    vector<Chunk> pool;
-    vector<size_t> freelist;
+    static const size_t SLAB_SIZE = 256 * 1024;
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+    static const size_t END = SIZE_MAX;
 
-public:
-    Pool(size_t capacity)
+    struct Slab
+    {
+        // objects in use
+        size_t live = 0;
+        // chunks before this one were used at least once since slab was committed
+        size_t touched = 0;
+        size_t free_head = END;
+        // was free at previous trim()
+        bool idle = false;
+    };
+
+    char *pool;
+    const size_t capacity;
+    size_t slab_chunks;
+    // slab size in bytes, multiple of page size
+    size_t slab_stride;
+    std::vector<Slab> slabs;
+    size_t area_size;
+    void *area;
+    // slabs below it have no free chunks
+    size_t lowest = 0;
+    size_t live = 0;
+    size_t committed = 0;
+    PoolWaiter *waiter = nullptr;
+
+    static size_t
+    slab_chunks_for(size_t slab_size)
     {
-        pool.resize(capacity);
-        freelist.reserve(capacity);
-        for (size_t id = 0; id < capacity; ++id)
-            freelist.push_back(id);
+        return slab_size > sizeof(Chunk) ? slab_size / sizeof(Chunk) : 1;
     }
 
     static size_t
-    memsize(size_t capacity = 1)
+    stride_for(size_t slab_size, size_t page)
     {
-        return (sizeof(Chunk) + sizeof(size_t)) * capacity;
+        size_t bytes = slab_chunks_for(slab_size) * sizeof(Chunk);
+        return (bytes + page - 1) / page * page;
     }
 
-    Chunk*
-    get(size_t &id) throw (std::bad_alloc)
+    static size_t
+    page_size()
+    {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        return page;
+    }
+
+    Chunk *
+    chunk(size_t id)
     {
-        if (freelist.size() == 0)
+        return (Chunk *) (pool + id / slab_chunks * slab_stride) + id % slab_chunks;
+    }
+
+    size_t &
+    next(size_t id)
+    {
+        return *(size_t *) chunk(id)->data;
+    }
+
+    bool
+    has_free(const Slab &slab) const
+    {
+        return slab.free_head != END || slab.touched < slab_chunks;
+    }
+
+public:
+    Pool(size_t capacity_, bool hugepages = false) :
+        capacity{capacity_},
+        slab_chunks{slab_chunks_for(hugepages ? HUGE_PAGE : SLAB_SIZE)},
+        slab_stride{stride_for(hugepages ? HUGE_PAGE : SLAB_SIZE, hugepages ? HUGE_PAGE : page_size())},
+        slabs((capacity_ + slab_chunks - 1) / slab_chunks)
+    {
+        area_size = slab_stride * slabs.size();
+        // huge page must be aligned, so area is reserved with margin
+        if (hugepages)
+            area_size += HUGE_PAGE;
+        area = mmap(nullptr, area_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (area == MAP_FAILED)
             throw std::bad_alloc();
+        pool = (char *) area;
+        if (hugepages) {
+            pool = (char *) (((uintptr_t) area + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+            // not fatal: transparent huge pages may be disabled
+            madvise(pool, slab_stride * slabs.size(), MADV_HUGEPAGE);
+        }
+    }
+    Pool(const Pool &) = delete;
+    ~Pool()
+    {
+        munmap(area, area_size);
+    }
+
+    // Reserved address space; memory is used by committed slabs only
+    static size_t
+    memsize(size_t capacity = 1, bool hugepages = false)
+    {
+        size_t chunks = slab_chunks_for(hugepages ? HUGE_PAGE : SLAB_SIZE);
+        size_t size = stride_for(hugepages ? HUGE_PAGE : SLAB_SIZE, hugepages ? HUGE_PAGE : page_size())
+                      * ((capacity + chunks - 1) / chunks);
+        // alignment margin, as in constructor
+        if (hugepages)
+            size += HUGE_PAGE;
+        return size;
+    }
 
-        id = freelist.back();
-        freelist.pop_back();
-        return &pool[id];
+    // nullptr when pool is exhausted, see notify()
+    Chunk*
+    get(size_t &id)
+    {
+        if (full())
+            return nullptr;
+        while (!has_free(slabs[lowest]))
+            ++lowest;
+        Slab &slab = slabs[lowest];
+        if (slab.free_head != END) {
+            id = slab.free_head;
+            slab.free_head = next(id);
+        } else {
+            if (slab.touched == 0)
+                ++committed;
+            id = lowest * slab_chunks + slab.touched++;
+        }
+        slab.idle = false;
+        ++slab.live;
+        ++live;
+        return chunk(id);
     }
 
     void
     release(size_t id)
     {
-        assert(id < pool.size());
-        freelist.push_back(id);
+        size_t s = id / slab_chunks;
+        assert(s < slabs.size() && id % slab_chunks < slabs[s].touched);
+        Slab &slab = slabs[s];
+        next(id) = slab.free_head;
+        slab.free_head = id;
+        --slab.live;
+        if (s < lowest)
+            lowest = s;
+        if (live-- == capacity && waiter) {
+            PoolWaiter *w = waiter;
+            waiter = nullptr;
+            w->pool_available();
+        }
+    }
+
+    bool
+    full() const
+    {
+        return live == capacity;
+    }
+
+    // Call w->pool_available() when exhausted pool gets free chunk
+    void
+    notify(PoolWaiter *w)
+    {
+        waiter = w;
+    }
+
+    /* Give back to system slabs which were free since previous call.
+       The first slab is kept, so that pool does not thrash under light load. */
+    void
+    trim()
+    {
+        for (size_t s = 1; s < slabs.size(); ++s) {
+            Slab &slab = slabs[s];
+            if (slab.touched == 0 || slab.live)
+                continue;
+            if (!slab.idle) {
+                slab.idle = true;
+                continue;
+            }
+            madvise(pool + s * slab_stride, slab_stride, MADV_DONTNEED);
+            slab = Slab();
+            --committed;
+        }
+    }
+
+    // objects in use
+    size_t
+    size() const
+    {
+        return live;
+    }
+
+    // memory of committed slabs
+    size_t
+    committed_size() const
+    {
+        return committed * slab_stride;
+    }
+
+    size_t
+    max_size() const
+    {
+        return capacity;
     }
 };
 
@@ -79,14 +262,22 @@ public:
         pool.release(id);
     }
 
-    void * operator new(size_t count, Pool<Object> &pool) throw(std::bad_alloc)
+    void * operator new(size_t count, Pool<Object> &pool)
     {
         pool_ = &pool;
-        return pool.get(id_);
+        void *chunk = pool.get(id_);
+        if (!chunk)
+            throw std::bad_alloc();
+        return chunk;
     }
     void operator delete (void * addr)
     {
     }
+    // object constructor has thrown
+    void operator delete (void * addr, Pool<Object> &pool)
+    {
+        pool.release(id_);
+    }
 };
 
 #endif // __cd_pool_h
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include "response.h"
+
+static const char *
+reason_phrase(unsigned status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Unknown";
+    }
+}
+
+Response::Response(unsigned status, bool keep_alive, const std::string &body) :
+    body_{body}
+{
+    set_header(status, keep_alive);
+}
+
+void
+Response::set_header(unsigned status, bool keep_alive)
+{
+    char header[128];
+    int len = snprintf(header, sizeof(header), "HTTP/1.1 %u %s\r\nConnection: %s\r\nContent-Length: %zu\r\n\r\n",
+                       status, reason_phrase(status), keep_alive ? "keep-alive" : "close", body_.size());
+    header_.assign(header, len);
+}
+
+int
+Response::unsent(size_t sent_size, struct iovec iov[2], bool with_body) const
+{
+    int count = 0;
+    if (sent_size < header_.size()) {
+        iov[count].iov_base = (void *) (header_.data() + sent_size);
+        iov[count].iov_len = header_.size() - sent_size;
+        ++count;
+        sent_size = 0;
+    } else {
+        sent_size -= header_.size();
+    }
+    if (with_body && sent_size < body_.size()) {
+        iov[count].iov_base = (void *) (body_.data() + sent_size);
+        iov[count].iov_len = body_.size() - sent_size;
+        ++count;
+    }
+    return count;
+}
+
+ResponseTable::ResponseTable() :
+    unavailable_(503, false, std::string()),
+    timeout_(504, false, std::string())
+{
+}
+
+void
+ResponseTable::set_route(unsigned route, unsigned status, const std::string &body)
+{
+    if (routes_.size() < (route + 1) * 2)
+        routes_.resize((route + 1) * 2);
+    routes_[route * 2] = Response(status, false, body);
+    routes_[route * 2 + 1] = Response(status, true, body);
+}
@@ -0,0 +1,82 @@
+#ifndef __cd_response_h
+#define __cd_response_h
+
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+/* Pre-serialized HTTP response: status line with headers and body are kept
+   in separate blobs and are sent together by one writev()/sendmsg().
+   Responses are built at startup and never change afterwards, so they are
+   shared by all threads and may be sent without copying (MSG_ZEROCOPY).
+   Reply built per request (statistics) is filled in place by body() and
+   set_header(), so reused object does not allocate. */
+class Response
+{
+    std::string header_;
+    std::string body_;
+
+public:
+    Response() {}
+    Response(unsigned status, bool keep_alive, const std::string &body);
+
+    std::string &
+    body()
+    {
+        return body_;
+    }
+
+    // Builds status line and headers for current body
+    void set_header(unsigned status, bool keep_alive);
+
+    // reply to HEAD request has no body
+    size_t size(bool with_body = true) const
+    {
+        return header_.size() + (with_body ? body_.size() : 0);
+    }
+
+    size_t body_size() const
+    {
+        return body_.size();
+    }
+
+    // Fill iov with part of response not sent yet; returns count of used iov entries
+    int unsent(size_t sent_size, struct iovec iov[2], bool with_body = true) const;
+};
+
+/* Responses of all routes, built once before accept threads are started.
+   Route key is the service detected by request parser. */
+class ResponseTable
+{
+    // two variants per route: [keep_alive]
+    std::vector<Response> routes_;
+    Response unavailable_;
+    Response timeout_;
+
+public:
+    ResponseTable();
+
+    void set_route(unsigned route, unsigned status, const std::string &body);
+
+    const Response &
+    route(unsigned route, bool keep_alive) const
+    {
+        return routes_[route * 2 + keep_alive];
+    }
+
+    // reply to request rejected because of overload; connection is always closed
+    const Response &
+    unavailable() const
+    {
+        return unavailable_;
+    }
+
+    // reply to request which was not done before deadline; connection is always closed
+    const Response &
+    timeout() const
+    {
+        return timeout_;
+    }
+};
+
+#endif // __cd_response_h
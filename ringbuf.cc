@@ -0,0 +1,97 @@
+#include <new>
+#include <cstring>
+#include <cassert>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "main_opts.h"
+#include "ringbuf.h"
+#include "util.h"
+
+size_t
+RingSlab::page_round(size_t size)
+{
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+RingSlab::RingSlab(size_t ring_size_, size_t capacity_) :
+    ring_size{page_round(ring_size_)},
+    capacity{capacity_}
+{
+    fd = memfd_create("ringslab", MFD_CLOEXEC);
+    if (fd == -1)
+        throw Errno("memfd_create");
+    // file is sparse: only touched pages take memory
+    if (ftruncate(fd, ring_size * capacity) == -1) {
+        close(fd);
+        throw Errno("ftruncate");
+    }
+    // address space only, slots are mapped over it
+    area = (char *) mmap(nullptr, ring_size * 2 * capacity, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        close(fd);
+        throw Errno("mmap");
+    }
+    freelist.reserve(capacity);
+}
+
+RingSlab::~RingSlab()
+{
+    munmap(area, ring_size * 2 * capacity);
+    close(fd);
+}
+
+void
+RingSlab::acquire(RingBuffer &ring)
+{
+    assert(!ring.valid());
+    size_t slot;
+    if (!freelist.empty()) {
+        slot = freelist.back();
+        freelist.pop_back();
+    } else {
+        if (mapped == capacity)
+            throw std::bad_alloc();
+        slot = mapped;
+        char *base = area + slot * ring_size * 2;
+        off_t offset = slot * ring_size;
+        // the same file pages twice, second mapping continues the first one
+        for (char *addr : {base, base + ring_size}) {
+            if (mmap(addr, ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+                /* Usually vm.max_map_count is reached: slot goes back to reserved
+                   address space, and it is exhaustion as when all slots are used. */
+                mmap(base, ring_size * 2, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+                throw std::bad_alloc();
+            }
+        }
+        ++mapped;
+    }
+    ring.base_ = area + slot * ring_size * 2;
+    ring.size_ = ring_size;
+    ring.head_ = 0;
+    ring.high_ = 0;
+    ring.slot_ = slot;
+}
+
+void
+RingSlab::release(RingBuffer &ring, size_t rest)
+{
+    assert(ring.valid());
+    size_t high = ring.head_ + rest;
+    if (high < ring.high_)
+        high = ring.high_;
+    size_t keep = page_round(1);
+    // wrapped data could touch any page
+    high = high > ring_size ? ring_size : page_round(high);
+    if (high > keep &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  ring.slot_ * ring_size + keep, high - keep) == -1) {
+        error("fallocate: ", strerror(errno));
+    }
+    freelist.push_back(ring.slot_);
+    ring.base_ = nullptr;
+}
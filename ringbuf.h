@@ -0,0 +1,101 @@
+#ifndef __cd_ringbuf_h
+#define __cd_ringbuf_h
+
+#include <cstddef>
+#include <vector>
+
+/* Connection buffer mapped twice into adjacent virtual addresses: byte at
+   offset i is also seen at offset i + size(). So any size() bytes starting
+   at any position are contiguous, data which wraps around the buffer end
+   is parsed and received without copying. Consumed request is dropped by
+   moving the start, pipelined data after it stays in place. */
+class RingBuffer
+{
+    friend class RingSlab;
+
+    char *base_ = nullptr;
+    size_t size_ = 0;
+    size_t head_ = 0;
+    // end of touched area relative to base_, pages below it may be committed
+    size_t high_ = 0;
+    size_t slot_ = 0;
+
+public:
+    RingBuffer() {}
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    bool
+    valid() const
+    {
+        return base_ != nullptr;
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+    // start of data, next size() bytes are contiguous
+    char *
+    data() const
+    {
+        return base_ + head_;
+    }
+
+    // Drop consumed bytes of data, rest bytes of data remain; returns new data start
+    char *
+    consume(size_t consumed, size_t rest)
+    {
+        size_t end = head_ + consumed + rest;
+        if (end > high_)
+            high_ = end;
+        // empty buffer starts over, so that the same pages are used again
+        head_ = rest ? (head_ + consumed) % size_ : 0;
+        return data();
+    }
+};
+
+/* Ring buffers of one accept thread. Buffer memory is taken from memfd,
+   which is allocated by kernel on first touch. Virtual space for all slots is
+   reserved at once; slot is mapped on first use and stays mapped, free slots
+   are reused in LIFO order. So number of mappings is bounded by peak number
+   of simultaneous buffers (see vm.max_map_count). Slab is not thread-safe. */
+class RingSlab
+{
+    int fd;
+    const size_t ring_size;
+    const size_t capacity;
+    char *area;
+    size_t mapped = 0;
+    std::vector<size_t> freelist;
+
+public:
+    // ring_size is rounded up to page size
+    RingSlab(size_t ring_size_, size_t capacity_);
+    RingSlab(const RingSlab&) = delete;
+    ~RingSlab();
+
+    static size_t page_round(size_t size);
+
+    size_t
+    size() const
+    {
+        return ring_size;
+    }
+
+    // Virtual memory reserved by slab; real memory usage is by touched pages only
+    static size_t
+    memsize(size_t ring_size, size_t capacity = 1)
+    {
+        return page_round(ring_size) * 2 * capacity;
+    }
+
+    // throws std::bad_alloc when all slots are used or slot can not be mapped
+    void acquire(RingBuffer &ring);
+    // rest: size of data left in ring, pages touched beyond the first one are given back
+    void release(RingBuffer &ring, size_t rest);
+};
+
+#endif // __cd_ringbuf_h
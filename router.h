@@ -0,0 +1,190 @@
+#ifndef __cd_router_h
+#define __cd_router_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Routes are declared in routes.def and resolved by perfect hash which is
+   built by compiler. Lookup hashes URI once, reads one displacement and
+   compares one route, so its cost does not depend on number of routes. */
+
+enum Service {
+    NOT_DEFINED = 0,
+#define ROUTE(service, path, handler) service,
+#include "routes.def"
+#undef ROUTE
+    SERVICE_COUNT
+};
+
+enum Handler {
+    // processed inside accept thread
+    INLINE = 0,
+    // passed to worker thread
+    OFFLOAD,
+    // connection is moved to worker event loop
+    MIGRATE
+};
+
+struct Route
+{
+    const char *path;
+    size_t path_size;
+    Handler handler;
+};
+
+// indexed by Service
+constexpr Route ROUTES[SERVICE_COUNT] = {
+    {nullptr, 0, INLINE},
+#define ROUTE(service, path, handler) {path, sizeof(path) - 1, handler},
+#include "routes.def"
+#undef ROUTE
+};
+
+// FNV-1a with final avalanche, so that both halves of result are usable
+constexpr uint64_t
+route_hash(const char *path, size_t size, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ull ^ seed;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+constexpr size_t
+pow2_above(size_t n, size_t p = 1)
+{
+    return p >= n ? p : pow2_above(n, p * 2);
+}
+
+/* Hash and displace: routes are split into buckets by one part of hash, then
+   for each bucket (the largest ones first) a displacement is searched which
+   puts all its routes into free slots. Slot is computed from another part of
+   hash and the displacement. */
+template <size_t N>
+class PerfectHash
+{
+    static constexpr size_t KEYS = N - 1; // routes[0] is NOT_DEFINED
+    static constexpr size_t BUCKETS = KEYS / 2 + 1;
+    static constexpr size_t SLOTS = pow2_above(KEYS * 2);
+    static constexpr uint64_t MAX_SEED = 64;
+
+    const Route *routes_;
+    uint64_t seed_;
+    uint32_t disp_[BUCKETS];
+    // Service of route in slot, NOT_DEFINED for empty one
+    uint16_t slots_[SLOTS];
+    bool ok_;
+
+    static constexpr size_t
+    bucket(uint64_t h)
+    {
+        return (h >> 32) % BUCKETS;
+    }
+
+    static constexpr size_t
+    slot(uint64_t h, uint32_t disp)
+    {
+        // odd step: displacements 0..SLOTS-1 visit every slot
+        return ((uint32_t) h + disp * ((uint32_t) (h >> 32) | 1)) & (SLOTS - 1);
+    }
+
+    // keys: routes of bucket b
+    constexpr bool
+    place(size_t b, const uint64_t (&hashes)[N], const uint16_t *keys, size_t count)
+    {
+        for (uint32_t disp = 0; disp < SLOTS; ++disp) {
+            size_t i = 0;
+            for (; i < count; ++i) {
+                size_t s = slot(hashes[keys[i]], disp);
+                if (slots_[s])
+                    break;
+                slots_[s] = keys[i];
+            }
+            if (i == count) {
+                disp_[b] = disp;
+                return true;
+            }
+            // roll back routes placed with this displacement
+            for (size_t j = 0; j < i; ++j)
+                slots_[slot(hashes[keys[j]], disp)] = NOT_DEFINED;
+        }
+        return false;
+    }
+
+    constexpr bool
+    build()
+    {
+        for (size_t s = 0; s < SLOTS; ++s)
+            slots_[s] = NOT_DEFINED;
+        uint64_t hashes[N] = {};
+        size_t bucket_size[BUCKETS] = {};
+        size_t max_size = 0;
+        for (size_t k = 1; k < N; ++k) {
+            hashes[k] = route_hash(routes_[k].path, routes_[k].path_size, seed_);
+            size_t size = ++bucket_size[bucket(hashes[k])];
+            if (size > max_size)
+                max_size = size;
+        }
+        // group routes by buckets
+        size_t bucket_start[BUCKETS + 1] = {};
+        for (size_t b = 0; b < BUCKETS; ++b)
+            bucket_start[b + 1] = bucket_start[b] + bucket_size[b];
+        uint16_t keys[N] = {};
+        size_t filled[BUCKETS] = {};
+        for (size_t k = 1; k < N; ++k) {
+            size_t b = bucket(hashes[k]);
+            keys[bucket_start[b] + filled[b]++] = k;
+        }
+        for (size_t size = max_size; size > 0; --size) {
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                if (bucket_size[b] == size && !place(b, hashes, &keys[bucket_start[b]], size))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    constexpr PerfectHash(const Route (&routes)[N]) :
+        routes_{routes},
+        seed_{0},
+        disp_{},
+        slots_{},
+        ok_{false}
+    {
+        // duplicate paths never fit, any seed
+        for (; seed_ < MAX_SEED; ++seed_) {
+            ok_ = build();
+            if (ok_)
+                break;
+        }
+    }
+
+    constexpr bool
+    ok() const
+    {
+        return ok_;
+    }
+
+    Service
+    find(const char *path, size_t size) const
+    {
+        uint64_t h = route_hash(path, size, seed_);
+        size_t service = slots_[slot(h, disp_[bucket(h)])];
+        const Route &route = routes_[service];
+        if (service && route.path_size == size && 0 == memcmp(route.path, path, size))
+            return (Service) service;
+        return NOT_DEFINED;
+    }
+};
+
+constexpr PerfectHash<SERVICE_COUNT> ROUTER(ROUTES);
+static_assert(ROUTER.ok(), "duplicate path in routes.def");
+
+#endif // __cd_router_h
@@ -0,0 +1,159 @@
+#include <cstring>
+#include <stdexcept>
+#include "scanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+// Register found delimiter; returns false when scanning must stop
+static inline bool
+on_delim(const char *buf, size_t pos, HeaderIndex &index)
+{
+    if (buf[pos] == ' ') {
+        if (index.lines == 0 && index.spaces < HeaderIndex::MAX_SPACES)
+            index.sp[index.spaces++] = pos;
+        return true;
+    }
+    if (index.lines == HeaderIndex::MAX_LINES) {
+        index.overflow = true;
+        return false;
+    }
+    size_t start = index.line_start(index.lines);
+    index.lf[index.lines++] = pos;
+    if (index.lines > 1 && pos == start + 1 && buf[start] == '\r') {
+        index.complete = true;
+        return false;
+    }
+    return true;
+}
+
+static size_t
+scan_generic(const char *buf, size_t pos, size_t end, HeaderIndex &index)
+{
+    // request line: spaces are needed too
+    for (; pos < end && index.lines == 0; ++pos) {
+        if ((buf[pos] == ' ' || buf[pos] == '\n') && !on_delim(buf, pos, index))
+            return pos + 1;
+    }
+    while (pos < end) {
+        const char *lf = (const char *) memchr(&buf[pos], '\n', end - pos);
+        if (!lf)
+            return end;
+        pos = lf - buf;
+        if (!on_delim(buf, pos++, index))
+            return pos;
+    }
+    return end;
+}
+
+#ifdef SCANNER_X86
+// Walk set bits of block mask; returns false when scanning must stop
+static inline bool
+on_mask(const char *buf, size_t &pos, unsigned mask, HeaderIndex &index)
+{
+    while (mask) {
+        size_t found = pos + __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (!on_delim(buf, found, index)) {
+            pos = found + 1;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Plain byte compares: SSE4.2 PCMPESTRM with delimiters set is several times
+   slower here, it is worth only for sets which do not fit two compares. */
+__attribute__((target("sse2")))
+static size_t
+scan_sse2(const char *buf, size_t pos, size_t end, HeaderIndex &index)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    while (pos + 16 <= end) {
+        __m128i block = _mm_loadu_si128((const __m128i *) &buf[pos]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+        // spaces matter only in request line
+        if (index.lines == 0)
+            mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(block, sp));
+        if (!on_mask(buf, pos, mask, index))
+            return pos;
+        pos += 16;
+    }
+    return scan_generic(buf, pos, end, index);
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const char *buf, size_t pos, size_t end, HeaderIndex &index)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    while (pos + 32 <= end) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) &buf[pos]);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+        if (index.lines == 0)
+            mask |= _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, sp));
+        if (!on_mask(buf, pos, mask, index))
+            return pos;
+        pos += 32;
+    }
+    return scan_generic(buf, pos, end, index);
+}
+#endif // SCANNER_X86
+
+bool
+Scanner::supported(Kind kind)
+{
+    switch (kind) {
+        case GENERIC:
+            return true;
+#ifdef SCANNER_X86
+        case SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+Scanner::Scanner() :
+    Scanner(supported(AVX2) ? AVX2 : supported(SSE2) ? SSE2 : GENERIC)
+{
+}
+
+Scanner::Scanner(Kind kind) :
+    kind_{kind}
+{
+    if (!supported(kind))
+        throw std::runtime_error("Scanner is not supported by CPU");
+    switch (kind) {
+#ifdef SCANNER_X86
+        case SSE2:
+            scan_ = scan_sse2;
+            break;
+        case AVX2:
+            scan_ = scan_avx2;
+            break;
+#endif
+        default:
+            scan_ = scan_generic;
+            break;
+    }
+}
+
+const char *
+Scanner::name() const
+{
+    switch (kind_) {
+        case SSE2: return "sse2";
+        case AVX2: return "avx2";
+        default: return "generic";
+    }
+}
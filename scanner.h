@@ -0,0 +1,85 @@
+#ifndef __cd_scanner_h
+#define __cd_scanner_h
+
+#include <cstddef>
+#include <cstdint>
+
+/* Delimiters of request head found by Scanner. Offsets are relative to
+   request start, request head is limited to 64K (see ReqParser). */
+struct HeaderIndex
+{
+    static const size_t MAX_LINES = 64;
+    static const size_t MAX_SPACES = 8;
+
+    // offset of LF terminating each line, the last one may terminate empty line
+    uint16_t lf[MAX_LINES];
+    size_t lines;
+    // offsets of spaces in request line (first line)
+    uint16_t sp[MAX_SPACES];
+    size_t spaces;
+    // empty line is found, it is the last line
+    bool complete;
+    // request head has more than MAX_LINES lines
+    bool overflow;
+
+    HeaderIndex()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        lines = 0;
+        spaces = 0;
+        complete = false;
+        overflow = false;
+    }
+
+    size_t line_start(size_t line) const
+    {
+        return line ? lf[line - 1] + 1 : 0;
+    }
+};
+
+/* Single-pass search of request head delimiters: LF of every line and
+   spaces of request line. Scanning is incremental: each call continues from
+   position returned by previous one, so bytes are never scanned twice.
+   It stops right after empty line, pipelined data after request is not touched.
+   Implementation is chosen at runtime by CPU features. */
+class Scanner
+{
+public:
+    enum Kind {
+        GENERIC = 0,
+        SSE2,
+        AVX2
+    };
+    // returns position where next scan starts
+    typedef size_t (*scan_f)(const char *buf, size_t pos, size_t end, HeaderIndex &index);
+
+private:
+    Kind kind_;
+    scan_f scan_;
+
+public:
+    // best implementation supported by CPU
+    Scanner();
+    Scanner(Kind kind);
+
+    static bool supported(Kind kind);
+    const char *name() const;
+
+    Kind
+    kind() const
+    {
+        return kind_;
+    }
+
+    size_t
+    operator()(const char *buf, size_t pos, size_t end, HeaderIndex &index) const
+    {
+        return scan_(buf, pos, end, index);
+    }
+};
+
+#endif // __cd_scanner_h
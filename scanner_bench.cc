@@ -0,0 +1,231 @@
+/* Microbenchmark of request head scanning: Scanner implementations against
+   memmem() search of CRLF, which was used by ReqParser before Scanner.
+
+   Usage: scanner-bench [milliseconds per case (200)] */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "scanner.h"
+
+static const size_t BUF_SIZE = 4096;
+
+static std::string
+make_request(const char *name)
+{
+    std::string req("GET /test/fast HTTP/1.1\r\n"
+                    "Host: localhost:9000\r\n");
+    if (!strcmp(name, "curl"))
+        return req + "User-Agent: curl/7.88.1\r\n"
+                     "Accept: */*\r\n"
+                     "\r\n";
+    req += "Connection: keep-alive\r\n"
+           "Cache-Control: max-age=0\r\n"
+           "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+           "sec-ch-ua-mobile: ?0\r\n"
+           "sec-ch-ua-platform: \"Linux\"\r\n"
+           "Upgrade-Insecure-Requests: 1\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+           "Chrome/118.0.0.0 Safari/537.36\r\n"
+           "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+           "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+           "Sec-Fetch-Site: none\r\n"
+           "Sec-Fetch-Mode: navigate\r\n"
+           "Sec-Fetch-User: ?1\r\n"
+           "Sec-Fetch-Dest: document\r\n"
+           "Accept-Encoding: gzip, deflate, br\r\n"
+           "Accept-Language: en-US,en;q=0.9\r\n";
+    if (!strcmp(name, "cookies")) {
+        req += "Cookie: ";
+        for (int i = 0; i < 24; ++i) {
+            char cookie[80];
+            snprintf(cookie, sizeof(cookie), "%scookie_%02d=4f9a1c2e7b3d5a6f8e0c1b2a3d4e5f60718293a4", i ? "; " : "", i);
+            req += cookie;
+        }
+        req += "\r\n";
+    }
+    return req + "\r\n";
+}
+
+/* Request head scan as done by ReqParser before Scanner: memmem() search of
+   each CRLF, end of head is detected by adjacent CRLFs, URI end by memchr(). */
+struct MemmemScan
+{
+    const char *buf;
+    size_t crlf_scan = 4; // after "GET "
+    const char *crlf_prev = nullptr;
+    size_t uri_size = 0;
+    size_t lines = 0;
+
+    MemmemScan(const char *buf_) : buf{buf_} {}
+
+    const char *
+    scan_for(size_t received_size)
+    {
+        if (crlf_scan >= received_size)
+            return 0;
+        size_t scan_size = received_size - crlf_scan;
+        if (scan_size >= 2) {
+            const char *found = (const char *) memmem(&buf[crlf_scan], scan_size, "\r\n", 2);
+            if (found) {
+                crlf_scan = found - buf + 2;
+                return found;
+            }
+            crlf_scan = received_size - 1;
+        }
+        return 0;
+    }
+
+    // returns request size when its end is found
+    size_t
+    feed(size_t received_size)
+    {
+        while (received_size >= 2 && crlf_scan <= received_size - 2) {
+            const char *crlf = scan_for(received_size);
+            if (!crlf)
+                break;
+            ++lines;
+            if (crlf_prev) {
+                if (crlf - crlf_prev == 2)
+                    return crlf - buf + 2;
+            } else {
+                size_t rest_size = crlf - buf - 4;
+                const char *uri_end = (const char *) memchr(&buf[5], ' ', rest_size - 1);
+                uri_size = uri_end ? uri_end - &buf[4] : rest_size;
+            }
+            crlf_prev = crlf;
+        }
+        return 0;
+    }
+};
+
+struct ScannerScan
+{
+    const Scanner &scanner;
+    const char *buf;
+    size_t scan_pos = 0;
+    size_t uri_size = 0;
+    size_t lines = 0;
+    HeaderIndex index;
+
+    ScannerScan(const Scanner &scanner_, const char *buf_) : scanner(scanner_), buf{buf_} {}
+
+    size_t
+    feed(size_t received_size)
+    {
+        scan_pos = scanner(buf, scan_pos, received_size, index);
+        if (index.lines && !uri_size)
+            uri_size = (index.spaces > 1 ? index.sp[1] : index.lf[0] - 1) - index.sp[0] - 1;
+        lines = index.lines;
+        return index.complete ? index.lf[index.lines - 1] + 1 : 0;
+    }
+};
+
+// Feed request in pieces of chunk bytes, as if it was received by several reads
+template <class Scan>
+static size_t
+run(Scan &scan, size_t size, size_t chunk)
+{
+    size_t received = 0;
+    while (received < size) {
+        received += chunk;
+        if (received > size)
+            received = size;
+        size_t request_size = scan.feed(received);
+        if (request_size)
+            return request_size + scan.uri_size + scan.lines;
+    }
+    return 0;
+}
+
+template <class Make>
+static double
+measure(Make make, size_t size, size_t chunk, double duration_ms, size_t &checksum)
+{
+    typedef std::chrono::steady_clock clock;
+    size_t iterations = 0;
+    size_t batch = 1000;
+    clock::time_point start = clock::now();
+    double elapsed_ns;
+    do {
+        for (size_t i = 0; i < batch; ++i) {
+            auto scan = make();
+            checksum += run(scan, size, chunk);
+        }
+        iterations += batch;
+        elapsed_ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    } while (elapsed_ns < duration_ms * 1e6);
+    return elapsed_ns / iterations;
+}
+
+static bool
+same_index(const HeaderIndex &a, const HeaderIndex &b)
+{
+    return a.lines == b.lines && a.spaces == b.spaces && a.complete == b.complete &&
+        0 == memcmp(a.lf, b.lf, a.lines * sizeof(a.lf[0])) &&
+        0 == memcmp(a.sp, b.sp, a.spaces * sizeof(a.sp[0]));
+}
+
+int
+main(int argc, char **argv)
+{
+    double duration_ms = argc > 1 ? atof(argv[1]) : 200;
+    std::vector<Scanner> scanners;
+    for (Scanner::Kind kind : {Scanner::GENERIC, Scanner::SSE2, Scanner::AVX2})
+        if (Scanner::supported(kind))
+            scanners.push_back(Scanner(kind));
+
+    printf("%-8s %6s %6s %-8s %10s %10s %8s\n",
+           "request", "bytes", "chunk", "scan", "ns/req", "MB/s", "speedup");
+    size_t checksum = 0;
+    for (const char *name : {"curl", "browser", "cookies"}) {
+        std::string request = make_request(name);
+        // request is followed by pipelined one, which must not be scanned
+        std::string data = request + request;
+        if (data.size() > BUF_SIZE) {
+            fprintf(stderr, "%s request is too large\n", name);
+            return 1;
+        }
+        char buf[BUF_SIZE];
+        memcpy(buf, data.data(), data.size());
+
+        // all implementations must produce the same index
+        ScannerScan reference(scanners[0], buf);
+        if (run(reference, data.size(), data.size()) == 0 ||
+            (size_t) reference.index.lf[reference.index.lines - 1] + 1 != request.size()) {
+            fprintf(stderr, "%s: generic scanner failed\n", name);
+            return 1;
+        }
+        for (const Scanner &scanner : scanners) {
+            for (size_t chunk = 1; chunk <= request.size(); chunk = chunk * 2 + 1) {
+                ScannerScan scan(scanner, buf);
+                run(scan, data.size(), chunk);
+                if (!same_index(scan.index, reference.index)) {
+                    fprintf(stderr, "%s: %s scanner index differs (chunk %zu)\n", name, scanner.name(), chunk);
+                    return 1;
+                }
+            }
+        }
+
+        for (size_t chunk : {data.size(), (size_t) 64}) {
+            double base = measure([&] { return MemmemScan(buf); }, data.size(), chunk, duration_ms, checksum);
+            printf("%-8s %6zu %6zu %-8s %10.1f %10.1f %8s\n",
+                   name, request.size(), chunk < data.size() ? chunk : 0, "memmem",
+                   base, request.size() * 1e3 / base, "1.00");
+            for (const Scanner &scanner : scanners) {
+                double ns = measure([&] { return ScannerScan(scanner, buf); }, data.size(), chunk, duration_ms, checksum);
+                char speedup[16];
+                snprintf(speedup, sizeof(speedup), "%.2f", base / ns);
+                printf("%-8s %6zu %6zu %-8s %10.1f %10.1f %8s\n",
+                       name, request.size(), chunk < data.size() ? chunk : 0, scanner.name(),
+                       ns, request.size() * 1e3 / ns, speedup);
+            }
+        }
+    }
+    // keeps results alive for optimizer
+    fprintf(stderr, "checksum: %zu\n", checksum);
+    return 0;
+}
@@ -0,0 +1,428 @@
+/* Load generator for server-demo: epoll-driven connections in several threads,
+   closed loop (next request is sent when response comes) or open loop (requests
+   are sent at fixed rate, latency is counted from the scheduled send time, so
+   stalls of server are not hidden by waiting client). Result is printed as one
+   JSON object: throughput and latency percentiles from merged histograms.
+
+   Usage: server-bench [options], see server-bench --help */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "histogram.h"
+
+struct Config
+{
+    const char *host = "127.0.0.1";
+    int port = 9000;
+    int threads = 1;
+    int connections = 16;
+    double duration = 5;
+    // requests per second of all threads, 0 - closed loop
+    double rate = 0;
+    // requests per connection, 0 - unlimited
+    int reuse = 0;
+    // requests in flight per connection
+    int depth = 1;
+    // percentage of /test/slow requests
+    int slow = 0;
+};
+
+static Config config;
+static sockaddr_in server_addr;
+
+static uint64_t
+now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Result
+{
+    Histogram latency;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t connects = 0;
+    uint64_t bytes = 0;
+};
+
+class Connection
+{
+public:
+    int fd = -1;
+    // requests sent on current socket
+    int sent = 0;
+    // send (or scheduled send) times of requests in flight, oldest first
+    std::deque<uint64_t> inflight;
+    std::string out;
+    size_t out_pos = 0;
+    std::string in;
+    bool closing = false;
+
+    bool
+    can_send() const
+    {
+        return fd != -1 && !closing && (int) inflight.size() < config.depth;
+    }
+};
+
+class Worker
+{
+    int epoll_fd;
+    std::vector<Connection> conns;
+    uint64_t rng;
+    uint64_t deadline;
+    // open loop: time of next scheduled request and requests waiting for connection
+    uint64_t interval = 0;
+    uint64_t next_send = 0;
+    std::deque<uint64_t> backlog;
+    size_t next_conn = 0;
+
+public:
+    Result result;
+
+    Worker(int id, int conn_count) :
+        conns(conn_count),
+        rng(0x9e3779b97f4a7c15ull * (id + 1))
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (config.rate > 0)
+            interval = (uint64_t) (1e9 * config.threads / config.rate);
+    }
+    ~Worker()
+    {
+        for (auto &c: conns) {
+            if (c.fd != -1)
+                close(c.fd);
+        }
+        close(epoll_fd);
+    }
+
+    bool
+    slow_request()
+    {
+        // xorshift64
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return (int) (rng % 100) < config.slow;
+    }
+
+    void
+    open(Connection &c)
+    {
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c.fd, (sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
+            close(c.fd);
+            c.fd = -1;
+            ++result.errors;
+            return;
+        }
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+        ++result.connects;
+        c.sent = 0;
+        c.closing = false;
+        c.in.clear();
+        c.out.clear();
+        c.out_pos = 0;
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    // Drops connection; requests in flight are lost
+    void
+    reset(Connection &c, bool error)
+    {
+        if (error)
+            result.errors += c.inflight.size() ? c.inflight.size() : 1;
+        c.inflight.clear();
+        close(c.fd);
+        c.fd = -1;
+    }
+
+    void
+    flush(Connection &c)
+    {
+        while (c.out_pos < c.out.size()) {
+            ssize_t n = send(c.fd, &c.out[c.out_pos], c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN)
+                    break;
+                reset(c, true);
+                return;
+            }
+            c.out_pos += n;
+        }
+        if (c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+        }
+        epoll_event ev;
+        ev.events = c.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+        ev.data.ptr = &c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void
+    send_request(Connection &c, uint64_t start)
+    {
+        ++c.sent;
+        bool last = config.reuse && c.sent >= config.reuse;
+        c.out += slow_request() ? "GET /test/slow HTTP/1.1\r\n" : "GET /test/fast HTTP/1.1\r\n";
+        c.out += last ? "Host: bench\r\nConnection: close\r\n\r\n" : "Host: bench\r\n\r\n";
+        c.closing = last;
+        c.inflight.push_back(start);
+    }
+
+    // Closed loop: fill the pipeline of connection
+    void
+    refill(Connection &c)
+    {
+        if (c.fd == -1)
+            open(c);
+        if (c.fd == -1)
+            return;
+        while (c.can_send())
+            send_request(c, now_ns());
+        flush(c);
+    }
+
+    // Open loop: give due requests to connections which have room
+    void
+    schedule(uint64_t now)
+    {
+        while (next_send <= now && next_send < deadline) {
+            backlog.push_back(next_send);
+            next_send += interval;
+        }
+        for (size_t tries = 0; !backlog.empty() && tries < conns.size(); ++tries) {
+            Connection &c = conns[next_conn];
+            next_conn = (next_conn + 1) % conns.size();
+            if (c.fd == -1)
+                open(c);
+            if (!c.can_send())
+                continue;
+            while (!backlog.empty() && c.can_send()) {
+                send_request(c, backlog.front());
+                backlog.pop_front();
+            }
+            flush(c);
+            tries = 0;
+        }
+    }
+
+    // Takes complete responses from input; returns false if connection is to be closed
+    bool
+    parse(Connection &c, uint64_t now)
+    {
+        while (true) {
+            size_t head_end = c.in.find("\r\n\r\n");
+            if (head_end == std::string::npos)
+                return true;
+            size_t body_size = 0;
+            size_t pos = c.in.find("Content-Length:");
+            if (pos != std::string::npos && pos < head_end)
+                body_size = strtoul(&c.in[pos + 15], nullptr, 10);
+            size_t size = head_end + 4 + body_size;
+            if (c.in.size() < size)
+                return true;
+            bool ok = c.in.compare(0, 12, "HTTP/1.1 200") == 0;
+            bool close_conn = c.in.find("Connection: close") < head_end;
+            c.in.erase(0, size);
+            if (c.inflight.empty())
+                return false;
+            if (ok) {
+                ++result.requests;
+                result.latency.record(now - c.inflight.front());
+            } else {
+                ++result.errors;
+            }
+            result.bytes += size;
+            c.inflight.pop_front();
+            if (close_conn)
+                return false;
+        }
+    }
+
+    void
+    on_event(Connection &c, uint32_t events, uint64_t now)
+    {
+        if (events & EPOLLOUT)
+            flush(c);
+        if (c.fd == -1 || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            return;
+        char buf[65536];
+        while (true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, n);
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN)
+                break;
+            // peer closed: what was not answered is lost
+            parse(c, now);
+            reset(c, !c.inflight.empty());
+            return;
+        }
+        if (!parse(c, now))
+            reset(c, !c.inflight.empty());
+    }
+
+    void
+    run()
+    {
+        uint64_t start = now_ns();
+        deadline = start + (uint64_t) (config.duration * 1e9);
+        next_send = start;
+        if (!interval) {
+            for (auto &c: conns)
+                refill(c);
+        }
+        epoll_event events[256];
+        while (true) {
+            uint64_t now = now_ns();
+            if (now >= deadline)
+                break;
+            if (interval)
+                schedule(now);
+            uint64_t wake = interval ? std::min(next_send, deadline) : deadline;
+            int timeout = wake > now ? (int) ((wake - now + 999999) / 1000000) : 0;
+            int n = epoll_wait(epoll_fd, events, 256, timeout);
+            now = now_ns();
+            for (int i = 0; i < n; ++i) {
+                Connection &c = *(Connection *) events[i].data.ptr;
+                on_event(c, events[i].events, now);
+                if (!interval && now < deadline)
+                    refill(c);
+            }
+        }
+    }
+};
+
+static void
+usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+           "  -H, --host=addr         server address (127.0.0.1)\n"
+           "  -p, --port=num          server port (9000)\n"
+           "  -t, --threads=num       client threads (1)\n"
+           "  -c, --connections=num   connections of all threads (16)\n"
+           "  -d, --duration=sec      test duration in seconds (5)\n"
+           "  -r, --rate=num          open loop: requests per second of all threads (0 - closed loop)\n"
+           "  -k, --reuse=num         requests per connection, then it is reopened (0 - unlimited)\n"
+           "  -P, --pipeline=num      requests in flight per connection (1)\n"
+           "  -s, --slow=percent      percentage of /test/slow requests, the rest are /test/fast (0)\n"
+           "Exit status is 2 if any request failed.\n",
+           prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const option options[] = {
+        {"host", required_argument, nullptr, 'H'},
+        {"port", required_argument, nullptr, 'p'},
+        {"threads", required_argument, nullptr, 't'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"reuse", required_argument, nullptr, 'k'},
+        {"pipeline", required_argument, nullptr, 'P'},
+        {"slow", required_argument, nullptr, 's'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:t:c:d:r:k:P:s:h", options, nullptr)) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'k': config.reuse = atoi(optarg); break;
+            case 'P': config.depth = atoi(optarg); break;
+            case 's': config.slow = atoi(optarg); break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.threads < 1 || config.connections < config.threads || config.depth < 1 || config.duration <= 0) {
+        fprintf(stderr, "each thread needs at least 1 connection, pipeline and duration must be positive\n");
+        return 1;
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        addrinfo hints = {}, *info;
+        hints.ai_family = AF_INET;
+        if (getaddrinfo(config.host, nullptr, &hints, &info) != 0) {
+            fprintf(stderr, "unknown host %s\n", config.host);
+            return 1;
+        }
+        server_addr.sin_addr = ((sockaddr_in *) info->ai_addr)->sin_addr;
+        freeaddrinfo(info);
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < config.threads; ++i) {
+        int conn_count = config.connections / config.threads + (i < config.connections % config.threads);
+        workers.emplace_back(new Worker(i, conn_count));
+    }
+    uint64_t start = now_ns();
+    std::vector<std::thread> threads;
+    for (auto &w: workers)
+        threads.emplace_back(&Worker::run, w.get());
+    for (auto &t: threads)
+        t.join();
+    double elapsed = (now_ns() - start) / 1e9;
+
+    Result total;
+    for (auto &w: workers) {
+        total.latency.merge(w->result.latency);
+        total.requests += w->result.requests;
+        total.errors += w->result.errors;
+        total.connects += w->result.connects;
+        total.bytes += w->result.bytes;
+    }
+    const Histogram &h = total.latency;
+    printf("{\"mode\": \"%s\", \"threads\": %d, \"connections\": %d, \"pipeline\": %d, \"reuse\": %d, "
+           "\"slow_percent\": %d, \"target_rate\": %.0f, \"duration\": %.3f, "
+           "\"requests\": %llu, \"errors\": %llu, \"connects\": %llu, \"bytes\": %llu, \"throughput\": %.1f, "
+           "\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+           "\"p99.9\": %.1f, \"p99.99\": %.1f, \"max\": %.1f}}\n",
+           config.rate > 0 ? "open" : "closed", config.threads, config.connections, config.depth, config.reuse,
+           config.slow, config.rate, elapsed,
+           (unsigned long long) total.requests, (unsigned long long) total.errors,
+           (unsigned long long) total.connects, (unsigned long long) total.bytes, total.requests / elapsed,
+           h.min() / 1e3, h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+           h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.percentile(99.99) / 1e3, h.max() / 1e3);
+    return total.errors ? 2 : 0;
+}
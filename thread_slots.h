@@ -0,0 +1,101 @@
+#ifndef __cd_thread_slots_h
+#define __cd_thread_slots_h
+
+#include <atomic>
+#include <stdexcept>
+#include "threads.h"
+
+/* Objects of threads: each thread takes its own object on first local() call
+   and gives it back on exit, the object keeps its data for the next thread.
+   Only the owner writes object, any thread may read all objects by
+   for_each() without locks. Objects are cache-line aligned and are never
+   freed. One instance per T, because owner is found by thread_local. */
+template <class T, size_t MAX_THREADS = 4096>
+class ThreadSlots
+{
+    struct alignas(CACHE_LINE) Slot
+    {
+        T object;
+        std::atomic<bool> owned{false};
+    };
+
+    std::atomic<Slot *> slots_[MAX_THREADS];
+    std::atomic<size_t> used_{0};
+
+    Slot *
+    claim()
+    {
+        // gives slot back when thread exits
+        struct Release
+        {
+            Slot *slot = nullptr;
+            ~Release()
+            {
+                if (slot)
+                    slot->owned.store(false, std::memory_order_release);
+            }
+        };
+        static thread_local Release release;
+
+        size_t used = size();
+        for (size_t i = 0; i < used; ++i) {
+            Slot *slot = slots_[i].load(std::memory_order_acquire);
+            bool owned = false;
+            if (slot && slot->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+                release.slot = slot;
+                return slot;
+            }
+        }
+        size_t i = used_.fetch_add(1, std::memory_order_acq_rel);
+        if (i >= MAX_THREADS) {
+            used_.fetch_sub(1, std::memory_order_relaxed);
+            throw std::runtime_error("too many threads");
+        }
+        Slot *slot = new Slot;
+        slot->owned.store(true, std::memory_order_relaxed);
+        // readers skip the slot until it is published
+        slots_[i].store(slot, std::memory_order_release);
+        release.slot = slot;
+        return slot;
+    }
+
+    size_t
+    size() const
+    {
+        size_t used = used_.load(std::memory_order_acquire);
+        return used < MAX_THREADS ? used : MAX_THREADS;
+    }
+
+public:
+    ThreadSlots()
+    {
+        for (auto &slot: slots_)
+            slot.store(nullptr, std::memory_order_relaxed);
+    }
+    ThreadSlots(const ThreadSlots &) = delete;
+
+    // object of calling thread
+    T &
+    local()
+    {
+        static thread_local Slot *current = nullptr;
+        if (!current)
+            current = claim();
+        return current->object;
+    }
+
+    // f(T &object, size_t index) for objects of all threads, including exited ones
+    template <class F>
+    void
+    for_each(F f)
+    {
+        size_t used = size();
+        for (size_t i = 0; i < used; ++i) {
+            Slot *slot = slots_[i].load(std::memory_order_acquire);
+            if (slot)
+                f(slot->object, i);
+        }
+    }
+};
+
+#endif // __cd_thread_slots_h
@@ -2,18 +2,12 @@
 #include <cstring>
 #include <iostream>
 #include <cassert>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "threads.h"
-
-void
-TaskHolder::assign (TaskHolder &&h)
-{
-    // TODO: Check it is called actually
-    if (h.size_) {
-        memcpy(data_, h.data_, h.size_);
-        h.size_ = 0;
-    }
-
-}
+#include "affinity.h"
 
 Thread::Thread(ThreadManager &manager, size_t managed_id) :
     manager_{manager},
@@ -31,17 +25,20 @@ Thread::start()
 void
 Thread::loop()
 {
-    Task * task;
+    TaskHolder * task;
     try {
         while (true) {
             {
                 std::unique_lock<std::mutex> lock(sleep_mx_);
-                sleep_.wait(lock, [this] { return continue_; });
-                std::swap(task_in_, task_out_);
-                continue_ = false;
+                sleep_.wait(lock, [this] { return task_ != nullptr || stop_; });
+                if (!task_)
+                    return;
+                task = task_;
+                task_ = nullptr;
             }
-            (*task_out_)->execute();
-            manager_.release_thread(managed_id_);
+            (*task)->execute();
+            task->reset();
+            manager_.release_thread(managed_id_, task);
         }
     } catch (int err) {
         std::cerr << "Exiting thread with code " << err << "...\n";
@@ -51,28 +48,326 @@ Thread::loop()
 }
 
 void
-ThreadPool::spawn_threads(int thread_count)
+Thread::stop()
+{
+    std::lock_guard<std::mutex> lk(sleep_mx_);
+    stop_ = true;
+    sleep_.notify_one();
+}
+
+constexpr std::chrono::milliseconds ThreadPool::SIZING_PERIOD;
+
+void
+ThreadPool::spawn_threads(int thread_count, size_t queue_capacity_, bool work_stealing)
 {
+    live_threads_ = thread_count;
+    if (work_stealing && thread_count) {
+        stealing_.reset(new StealingScheduler(thread_count, queue_capacity_, cpus_));
+        return;
+    }
+    queue_capacity = queue_capacity_;
+    queue_slots.reset(new TaskHolder[queue_capacity]);
+    free_slots.reserve(queue_capacity);
+    for (size_t i = 0; i < queue_capacity; ++i)
+        free_slots.push_back(&queue_slots[i]);
+    task_queue.resize(queue_capacity);
+
     for (int i = 0; i < thread_count; ++i) {
         Thread *t = new Thread(*this, i);
         t->start();
         threads.push_back(thr_vec::value_type(t));
+        pin_thread((*t)->native_handle(), cpus_);
     }
     free_threads.reserve(threads.size());
     for (auto &t: threads)
         free_threads.push_back(t.get());
 }
 
+void
+ThreadPool::dispatch(Thread *thread)
+{
+    if (queue_size == 0) {
+        thread->idle_since = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(free_threads_mx_);
+        free_threads.push_back(thread);
+    } else {
+        TaskHolder *next = task_queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        --queue_size;
+        thread->assign_task(next);
+    }
+}
+
+void
+ThreadPool::release_thread(size_t managed_id, TaskHolder *done)
+{
+    std::lock_guard<std::mutex> lock(queue_mx_);
+    if (done >= &queue_slots[0] && done < &queue_slots[queue_capacity])
+        free_slots.push_back(done);
+    dispatch(threads[managed_id].get());
+}
+
+void
+ThreadPool::adapt(const SizingPolicy &policy, size_t reserved)
+{
+    if (stealing_ || policy.free_threshold == 0)
+        return;
+    std::lock_guard<std::mutex> lock(queue_mx_);
+    policy_ = policy;
+    reserved_ = std::min(reserved, live_threads_);
+    base_workers_ = live_threads_ - reserved_;
+    hunk_ = policy_.spawn_hunk;
+    sizer_ = std::thread(&ThreadPool::sizer_loop, this);
+}
+
+size_t
+ThreadPool::thread_count()
+{
+    std::lock_guard<std::mutex> lock(queue_mx_);
+    return live_threads_;
+}
+
+Thread *
+ThreadPool::add_thread()
+{
+    // ids of retired threads are reused
+    size_t id = 0;
+    while (id < threads.size() && threads[id])
+        ++id;
+    Thread *t = new Thread(*this, id);
+    if (id < threads.size())
+        threads[id].reset(t);
+    else
+        threads.push_back(thr_vec::value_type(t));
+    t->start();
+    pin_thread((*t)->native_handle(), cpus_);
+    ++live_threads_;
+    return t;
+}
+
+void
+ThreadPool::add_threads(size_t count)
+{
+    for (; count > 0; --count) {
+        // new thread takes queued task right away
+        dispatch(add_thread());
+    }
+}
+
+void
+ThreadPool::sizer_loop()
+{
+    std::unique_lock<std::mutex> lock(sizer_mx_);
+    while (!sizer_cv_.wait_for(lock, SIZING_PERIOD, [this] { return sizer_stop_; })) {
+        grow();
+        shrink();
+    }
+}
 
 void
-ThreadPool::release_thread(size_t managed_id)
+ThreadPool::grow()
 {
     std::lock_guard<std::mutex> lock(queue_mx_);
-    if (task_queue.empty()) {
+    size_t free;
+    {
         std::lock_guard<std::mutex> lock2(free_threads_mx_);
-        free_threads.push_back(threads[managed_id].get());
-    } else {
-        threads[managed_id]->assign_task(std::move(task_queue.front()));
-        task_queue.pop_front();
+        free = free_threads.size();
+    }
+    size_t workers = live_threads_ - reserved_;
+    if (free * 100 >= workers * policy_.free_threshold || live_threads_ >= policy_.thread_limit)
+        return;
+    size_t count = std::max<size_t>(1, workers * hunk_ / 100);
+    count = std::min(count, policy_.thread_limit - live_threads_);
+    add_threads(count);
+    spawned_.fetch_add(count, std::memory_order_relaxed);
+    // each next spawn is smaller, so that the pool settles
+    hunk_ = std::max(1u, hunk_ * (100 - policy_.spawn_factor) / 100);
+}
+
+void
+ThreadPool::shrink()
+{
+    if (policy_.idle_timeout.count() == 0)
+        return;
+    auto deadline = std::chrono::steady_clock::now() - policy_.idle_timeout;
+    vector<Thread *> retiring;
+    {
+        std::lock_guard<std::mutex> lock(queue_mx_);
+        std::lock_guard<std::mutex> lock2(free_threads_mx_);
+        // free threads are taken from the back, so the longest idle ones are in front
+        auto it = free_threads.begin();
+        for (; it != free_threads.end() && live_threads_ > reserved_ + base_workers_; ++it) {
+            if ((*it)->idle_since > deadline)
+                break;
+            retiring.push_back(*it);
+            --live_threads_;
+        }
+        free_threads.erase(free_threads.begin(), it);
+        if (live_threads_ == reserved_ + base_workers_)
+            hunk_ = policy_.spawn_hunk;
+    }
+    if (retiring.empty())
+        return;
+    for (Thread *t: retiring) {
+        t->stop();
+        (*t)->join();
+    }
+    std::lock_guard<std::mutex> lock(queue_mx_);
+    for (auto &t: threads) {
+        if (std::find(retiring.begin(), retiring.end(), t.get()) != retiring.end())
+            t.reset();
+    }
+    retired_.fetch_add(retiring.size(), std::memory_order_relaxed);
+}
+
+TaskRing::TaskRing(size_t capacity) :
+    slots_{new Slot[capacity]},
+    mask_{capacity - 1},
+    push_pos_{0},
+    pop_pos_{0}
+{
+    assert(capacity && (capacity & mask_) == 0);
+    for (size_t i = 0; i < capacity; ++i)
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+TaskHolder *
+TaskRing::pop(size_t &pos)
+{
+    pos = pop_pos_.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &slots_[pos & mask_];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (pop_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return nullptr;
+        } else {
+            pos = pop_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    return &slot->task;
+}
+
+void
+TaskRing::release(size_t pos)
+{
+    Slot *slot = &slots_[pos & mask_];
+    slot->task.reset();
+    slot->seq.store(pos + mask_ + 1, std::memory_order_release);
+}
+
+static inline void
+cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline int
+futex(std::atomic<int> &addr, int op, int val)
+{
+    return syscall(SYS_futex, reinterpret_cast<int *>(&addr), op, val, nullptr, nullptr, 0);
+}
+
+StealingScheduler::StealingScheduler(int thread_count, size_t queue_capacity, const vector<int> &cpus)
+{
+    /* Task is executed in place, so its ring slot is busy until the task ends.
+       One more slot per ring lets the owner execute a task while its share of
+       queue_capacity is queued; slots of tasks taken by thieves are not counted,
+       so the ring may be full earlier while they execute. Capacity of ring must
+       be power of 2. */
+    size_t per_ring = (queue_capacity + thread_count - 1) / thread_count + 1;
+    size_t ring_capacity = 1;
+    while (ring_capacity < per_ring)
+        ring_capacity <<= 1;
+    rings_.reserve(thread_count);
+    for (int i = 0; i < thread_count; ++i)
+        rings_.emplace_back(new TaskRing(ring_capacity));
+    threads_.reserve(thread_count);
+    for (int i = 0; i < thread_count; ++i) {
+        threads_.emplace_back(&StealingScheduler::loop, this, i);
+        pin_thread(threads_.back().native_handle(), cpus);
+    }
+}
+
+StealingScheduler::~StealingScheduler()
+{
+    for (auto &thread: threads_)
+        thread.detach();
+    // detached threads may still execute tasks from rings
+    for (auto &ring: rings_)
+        ring.release();
+}
+
+bool
+StealingScheduler::find_task(size_t id, Claim &claim)
+{
+    // own ring first, then steal from the others
+    size_t ring_count = rings_.size();
+    for (size_t i = 0; i < ring_count; ++i) {
+        claim.ring = rings_[(id + i) % ring_count].get();
+        claim.task = claim.ring->pop(claim.pos);
+        if (claim.task)
+            return true;
+    }
+    return false;
+}
+
+bool
+StealingScheduler::spin(size_t id, Claim &claim)
+{
+    for (int i = 0; i < SPIN_COUNT; ++i) {
+        cpu_relax();
+        if (find_task(id, claim))
+            return true;
+    }
+    return false;
+}
+
+bool
+StealingScheduler::park(size_t id, Claim &claim)
+{
+    /* Pairs with wake(): either producer sees our sleepers_ increment
+       or we see its pushed task on re-check. */
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    int seq = wake_seq_.load(std::memory_order_seq_cst);
+    bool found = find_task(id, claim);
+    if (!found)
+        futex(wake_seq_, FUTEX_WAIT_PRIVATE, seq);
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    return found;
+}
+
+void
+StealingScheduler::wake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        wake_seq_.fetch_add(1, std::memory_order_seq_cst);
+        futex(wake_seq_, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+void
+StealingScheduler::loop(size_t id)
+{
+    Claim claim;
+    try {
+        while (true) {
+            if (find_task(id, claim) || spin(id, claim) || park(id, claim)) {
+                if (!claim.task->empty())
+                    (*claim.task)->execute();
+                claim.ring->release(claim.pos);
+            }
+        }
+    } catch (int err) {
+        std::cerr << "Exiting thread with code " << err << "...\n";
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
     }
 }
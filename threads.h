@@ -1,72 +1,96 @@
 #ifndef __cd_threads_h
-#define __cd_trheads_h
+#define __cd_threads_h
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <vector>
-#include <deque>
+#include <type_traits>
 
 using std::vector;
-using std::deque;
 
 class Task
 {
 public:
+    virtual ~Task() {}
     virtual void execute() = 0;
 };
 
+class TaskHolder;
+
 class ThreadManager
 {
 public:
-    virtual void release_thread(size_t managed_id) = 0;
+    // done is the holder of just executed (and already destroyed) task
+    virtual void release_thread(size_t managed_id, TaskHolder *done) = 0;
 };
 
-const int MAX_TASK_SIZE = 96;
+const int MAX_TASK_SIZE = 128;
+const size_t CACHE_LINE = 64;
+
+inline void
+update_max(std::atomic<size_t> &max, size_t value)
+{
+    size_t cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+}
 
+/* Storage for one task of any Task descendant up to MAX_TASK_SIZE.
+   Task is constructed in place by emplace() and is destroyed by reset()
+   (or holder destructor). Holders are never copied or moved: task stays
+   where it was constructed until it is executed and destroyed. */
 class TaskHolder
 {
-    /* data_ MUST be first member in TaskHolder!
-       We will access Task (in data_) by TaskHolder*.
-       Yes, this is a dirty hack... */
-    char data_[MAX_TASK_SIZE];
-    size_t size_;
+    typename std::aligned_storage<MAX_TASK_SIZE>::type data_;
+    Task *task_ = nullptr;
+
+    TaskHolder(const TaskHolder &) = delete;
+    TaskHolder& operator= (const TaskHolder &) = delete;
 
 public:
-    TaskHolder() : size_{0} {}
+    TaskHolder() {}
+    ~TaskHolder()
+    {
+        reset();
+    }
 
-    template <class T>
-    TaskHolder (T &&y)
+    template <class T, class ... Args>
+    T *
+    emplace(Args&& ... args)
     {
-        assign(y);
+        static_assert (std::is_base_of<Task, T>::value, "T is not a descendant of Task!");
+        static_assert (sizeof(T) <= sizeof(data_), "TaskHolder capacity is not enough!");
+        reset();
+        T *task = new (&data_) T(std::forward<Args>(args)...);
+        task_ = task;
+        return task;
+    }
+
+    void reset()
+    {
+        if (task_) {
+            task_->~Task();
+            task_ = nullptr;
+        }
     }
 
-    template <class T>
-    TaskHolder& operator= (T &&y)
+    bool empty() const
     {
-        assign(y);
+        return task_ == nullptr;
     }
 
     Task *
     operator->()
     {
-        return (Task *) data_;
+        return task_;
     }
     operator Task*()
     {
-        return (Task *) data_;
-    }
-
-private:
-    template <class T>
-    void assign (T &y)
-    {
-        static_assert (std::is_base_of<Task, T>::value, "T is not a descendant of Task!");
-        static_assert (sizeof(T) <= sizeof(data_), "TaskHolder capacity is not enough!");
-        new (data_) T(std::move(y));
-        size_ = sizeof(T);
+        return task_;
     }
-    void assign (TaskHolder &&h);
 };
 
 
@@ -79,10 +103,11 @@ private:
     std::mutex sleep_mx_;
     std::condition_variable sleep_;
 
-    bool continue_ = false;
-    TaskHolder tasks_[2];
-    TaskHolder* task_in_ = &tasks_[0];
-    TaskHolder* task_out_ = &tasks_[1];
+    TaskHolder own_task_;
+    // task to execute next: own_task_ or slot owned by ThreadManager
+    TaskHolder* task_ = nullptr;
+    // free thread is asked to exit instead of waiting for task
+    bool stop_ = false;
 
     Thread(const Thread & copy) = delete;
 
@@ -93,64 +118,368 @@ public:
     virtual ~Thread() {}
 
     Thread* start();
+    // Makes free thread exit its loop; the caller joins it
+    void stop();
+
+    // time when thread became free, set by ThreadManager
+    std::chrono::steady_clock::time_point idle_since;
 
     std::thread* operator-> () { return &thread_; }
 
-    template <class AnyTask>
-    AnyTask* assign_task(AnyTask &&task)
+    /* Construct task directly in thread space. Must be called only for free thread
+       (own_task_ is not used while the thread is free). */
+    template <class T, class ... Args>
+    T* emplace_task(Args&& ... args)
     {
         std::lock_guard<std::mutex> lk(sleep_mx_);
-        /* TODO: avoid copying (moving actually) by returning space for placement new to task creator.
-           Task creator by placement new will construct object already in thread space. */
-        *task_in_ = std::move(task);
-        continue_ = true;
+        T *task = own_task_.emplace<T>(std::forward<Args>(args)...);
+        task_ = &own_task_;
 
         // notify() here is also guarded to prevent waiting thread
         // missing notify on kernel preemption (see SO:15072479)
         sleep_.notify_one();
-        return (AnyTask *)task_in_;
+        return task;
+    }
+
+    void assign_task(TaskHolder *task)
+    {
+        std::lock_guard<std::mutex> lk(sleep_mx_);
+        task_ = task;
+        sleep_.notify_one();
+    }
+};
+
+/* Bounded lock-free MPMC ring of TaskHolder slots (D. Vyukov's algorithm).
+   Any thread may push or pop, so the same ring serves as worker's own queue
+   and as a victim for stealing by idle workers. */
+class TaskRing
+{
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        TaskHolder task;
+    };
+
+    // push and pop positions are kept on different cache lines
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    char pad0_[CACHE_LINE];
+    std::atomic<size_t> push_pos_;
+    char pad1_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> pop_pos_;
+    char pad2_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+
+    TaskRing(const TaskRing &) = delete;
+
+public:
+    // capacity must be power of 2
+    TaskRing(size_t capacity);
+
+    // constructs task in free slot; returns nullptr if ring is full
+    template <class T, class ... Args>
+    T *
+    emplace(Args&& ... args)
+    {
+        size_t pos = push_pos_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots_[pos & mask_];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = push_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        T *task;
+        try {
+            task = slot->task.emplace<T>(std::forward<Args>(args)...);
+        } catch (...) {
+            // slot is already claimed: publish it empty, consumer will skip it
+            slot->seq.store(pos + 1, std::memory_order_release);
+            throw;
+        }
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return task;
+    }
+
+    /* Claims next task for execution. Task is executed in place, its slot
+       is not reused until release(pos) is called, so tasks which never end
+       must not be queued here (see ThreadPool::start_task()). */
+    TaskHolder *pop(size_t &pos);
+    void release(size_t pos);
+
+    // approximate number of queued tasks
+    size_t size() const
+    {
+        size_t pop_pos = pop_pos_.load(std::memory_order_relaxed);
+        return push_pos_.load(std::memory_order_relaxed) - pop_pos;
+    }
+};
+
+/* Worker scheduler without global locks: each worker owns bounded TaskRing,
+   producers distribute tasks round-robin, idle workers steal from rings of other workers.
+   Worker with nothing to do spins for a while, then parks on futex. */
+class StealingScheduler
+{
+    static const int SPIN_COUNT = 2000;
+
+    vector<std::unique_ptr<TaskRing> > rings_;
+    vector<std::thread> threads_;
+    char pad0_[CACHE_LINE];
+    std::atomic<int> sleepers_{0};
+    char pad1_[CACHE_LINE - sizeof(std::atomic<int>)];
+    std::atomic<int> wake_seq_{0};
+    char pad2_[CACHE_LINE - sizeof(std::atomic<int>)];
+    std::atomic<size_t> queue_hwm_{0};
+
+    struct Claim
+    {
+        TaskRing *ring;
+        TaskHolder *task;
+        size_t pos;
+    };
+
+    void loop(size_t id);
+    bool find_task(size_t id, Claim &claim);
+    bool spin(size_t id, Claim &claim);
+    bool park(size_t id, Claim &claim);
+    void wake();
+
+public:
+    // cpus: affinity of worker threads, empty - any CPU
+    StealingScheduler(int thread_count, size_t queue_capacity, const vector<int> &cpus);
+    ~StealingScheduler();
+
+    size_t queue_high_water() const
+    {
+        return queue_hwm_.load(std::memory_order_relaxed);
     }
 
+    template <class T, class ... Args>
+    T *
+    emplace_task(Args&& ... args)
+    {
+        // round-robin start position is per producer thread, so producers don't share it
+        static thread_local size_t next = 0;
+        size_t ring_count = rings_.size();
+        for (size_t i = 0; i < ring_count; ++i) {
+            TaskRing *ring = rings_[next++ % ring_count].get();
+            T *added = ring->emplace<T>(std::forward<Args>(args)...);
+            if (added) {
+                wake();
+                update_max(queue_hwm_, ring->size());
+                return added;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/* When and how much ThreadPool grows and shrinks (see ThreadPool::adapt()).
+   Percentages are of worker threads, that is threads which are not reserved
+   by long-living tasks (accept threads, worker loops). */
+struct SizingPolicy
+{
+    // spawn when free workers are fewer than this percentage; 0 - never
+    unsigned free_threshold = 0;
+    // spawn this percentage of existing workers at once
+    unsigned spawn_hunk = 50;
+    // decrease hunk by this percentage after each spawn
+    unsigned spawn_factor = 0;
+    // maximum total number of threads
+    size_t thread_limit = 1000;
+    // spawned worker which stays free this long exits; zero - never
+    std::chrono::milliseconds idle_timeout{0};
 };
 
 class ThreadPool : public ThreadManager
 {
 private:
+    static constexpr std::chrono::milliseconds SIZING_PERIOD{10};
+
     typedef vector<std::unique_ptr<Thread> > thr_vec;
     thr_vec threads;
     vector<Thread*> free_threads;
-    deque<TaskHolder> task_queue;
+    // preallocated holders for queued tasks
+    std::unique_ptr<TaskHolder[]> queue_slots;
+    size_t queue_capacity = 0;
+    vector<TaskHolder*> free_slots;
+    // FIFO of queued tasks: ring of pointers into queue_slots
+    vector<TaskHolder*> task_queue;
+    size_t queue_head = 0;
+    size_t queue_size = 0;
+    std::atomic<size_t> queue_hwm_{0};
     std::mutex free_threads_mx_;
     std::mutex queue_mx_;
+    std::unique_ptr<StealingScheduler> stealing_;
+    // affinity of all threads, accept tasks pin themselves further
+    vector<int> cpus_;
+
+    // pool sizing is done by separate thread, adding task costs the same
+    SizingPolicy policy_;
+    size_t reserved_ = 0;
+    size_t base_workers_ = 0;
+    unsigned hunk_ = 0;
+    size_t live_threads_ = 0;
+    std::thread sizer_;
+    std::mutex sizer_mx_;
+    std::condition_variable sizer_cv_;
+    bool sizer_stop_ = false;
+    std::atomic<size_t> spawned_{0};
+    std::atomic<size_t> retired_{0};
+
+    virtual void release_thread(size_t managed_id, TaskHolder *done);
+
+    // Thread is given queued task or becomes free; queue_mx_ must be held
+    void dispatch(Thread *thread);
+    // Starts thread which is not free yet; queue_mx_ must be held
+    Thread *add_thread();
+    void add_threads(size_t count);
+    void sizer_loop();
+    void grow();
+    void shrink();
+
+    Thread *
+    pop_free_thread()
+    {
+        if (free_threads.empty())
+            return nullptr;
+        Thread *thread = free_threads.back();
+        free_threads.pop_back();
+        return thread;
+    }
+
+    template <class T, class ... Args>
+    T *
+    emplace_thread(Thread *thread, Args&& ... args)
+    {
+        try {
+            return thread->emplace_task<T>(std::forward<Args>(args)...);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(free_threads_mx_);
+            free_threads.push_back(thread);
+            throw;
+        }
+    }
 
-    virtual void release_thread(size_t managed_id);
 public:
-    void spawn_threads(int thread_count);
+    // CPUs for threads spawned after this call
+    void pin_threads(const vector<int> &cpus)
+    {
+        cpus_ = cpus;
+    }
+
+    /* queue_capacity is maximum number of tasks waiting for a free thread;
+       in work stealing mode it is divided between worker queues. */
+    void spawn_threads(int thread_count, size_t queue_capacity, bool work_stealing = false);
+
+    /* Starts adapting number of worker threads to load. reserved is number of
+       threads busy with tasks which never end; it is ignored in work stealing
+       mode, where each thread owns its queue. */
+    void adapt(const SizingPolicy &policy, size_t reserved);
+
+    // number of running threads
+    size_t thread_count();
+
+    // threads spawned and retired by adapt() policy so far
+    size_t spawned() const
+    {
+        return spawned_.load(std::memory_order_relaxed);
+    }
+    size_t retired() const
+    {
+        return retired_.load(std::memory_order_relaxed);
+    }
+
+    // maximum observed number of waiting tasks (per worker queue in work stealing mode)
+    size_t queue_high_water() const
+    {
+        if (stealing_)
+            return stealing_->queue_high_water();
+        return queue_hwm_.load(std::memory_order_relaxed);
+    }
+
+    /* Constructs task of type T from args directly in memory where it will be executed:
+       in space of free thread, or in preallocated queue slot if all threads are busy.
+       Returns pointer to constructed task or nullptr if task was not accepted
+       because the queue is full. */
+    template <class T, class ... Args>
+    T *
+    emplace_task(Args&& ... args)
+    {
+        if (stealing_)
+            return stealing_->emplace_task<T>(std::forward<Args>(args)...);
+
+        Thread *thread;
+        {
+            std::lock_guard<std::mutex> lock(free_threads_mx_);
+            thread = pop_free_thread();
+        }
+        if (thread)
+            return emplace_thread<T>(thread, std::forward<Args>(args)...);
+
+        std::lock_guard<std::mutex> lock(queue_mx_);
+        {
+            // thread could be released while we were not holding queue_mx_
+            std::lock_guard<std::mutex> lock2(free_threads_mx_);
+            thread = pop_free_thread();
+        }
+        if (thread)
+            return emplace_thread<T>(thread, std::forward<Args>(args)...);
+
+        if (free_slots.empty())
+            return nullptr;
+        T *task = free_slots.back()->emplace<T>(std::forward<Args>(args)...);
+        task_queue[(queue_head + queue_size) % queue_capacity] = free_slots.back();
+        free_slots.pop_back();
+        ++queue_size;
+        update_max(queue_hwm_, queue_size);
+        return task;
+    }
+
+    /* Constructs task which never ends (event loop) in space of a new thread of its own.
+       It does not take a worker: in work stealing mode its queue slot would never be free.
+       Without work stealing the thread becomes worker if the task ends. */
+    template <class T, class ... Args>
+    T *
+    start_task(Args&& ... args)
+    {
+        std::lock_guard<std::mutex> lock(queue_mx_);
+        return emplace_thread<T>(add_thread(), std::forward<Args>(args)...);
+    }
 
     template <class AnyTask>
     AnyTask *
     add_task(AnyTask &task)
     {
-        std::unique_lock<std::mutex> lock(free_threads_mx_);
-        if (!free_threads.empty()) {
-            Thread *thread;
-            {
-                thread = free_threads.back();
-                free_threads.pop_back();
-            }
-            return thread->assign_task(std::move(task));
-        } else {
-            lock.unlock();
-            std::lock_guard<std::mutex> lock(queue_mx_);
-            task_queue.push_back(task);
-            return static_cast<AnyTask *>(&(*task_queue.back()));
-        }
+        return emplace_task<AnyTask>(std::move(task));
     }
+
     virtual ~ThreadPool()
     {
+        if (sizer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(sizer_mx_);
+                sizer_stop_ = true;
+            }
+            sizer_cv_.notify_one();
+            sizer_.join();
+        }
         for (auto &thread: threads) {
-            (*thread)->detach();
+            if (thread)
+                (*thread)->detach();
         }
+        /* Detached threads may still execute tasks, so their memory is left
+           to the system, as well as queued tasks. */
+        for (auto &thread: threads)
+            thread.release();
+        queue_slots.release();
+        stealing_.release();
     }
 };
 
@@ -0,0 +1,138 @@
+#include <cmath>
+#include <cassert>
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(double tick) :
+    tick_{tick}
+{
+    ev_timer_init(&tick_watcher_, tick_callback, tick_, tick_);
+    tick_watcher_.data = this;
+}
+
+TimerWheel::~TimerWheel()
+{
+    detach();
+}
+
+void
+TimerWheel::attach(struct ev_loop *event_loop)
+{
+    event_loop_ = event_loop;
+    now_ = ticks(ev_now(event_loop_));
+    if (size_)
+        ev_timer_start(event_loop_, &tick_watcher_);
+}
+
+void
+TimerWheel::detach()
+{
+    if (event_loop_) {
+        ev_timer_stop(event_loop_, &tick_watcher_);
+        event_loop_ = nullptr;
+    }
+}
+
+void
+TimerWheel::link(TimerHandler *handler)
+{
+    static const uint64_t RANGE = 1ull << (LEVELS * SLOT_BITS);
+    uint64_t delay = handler->expires_ > now_ ? handler->expires_ - now_ : 0;
+    if (delay >= RANGE) {
+        delay = RANGE - 1;
+        handler->expires_ = now_ + delay;
+    }
+    // overdue timer runs on the next tick
+    uint64_t expires = now_ + delay;
+    unsigned level = 0;
+    while (delay >= 1ull << ((level + 1) * SLOT_BITS))
+        ++level;
+    TimerHandler **head = &slots_[level][(expires >> (level * SLOT_BITS)) & (SLOTS - 1)];
+    handler->next_timer_ = *head;
+    if (*head)
+        (*head)->pprev_timer_ = &handler->next_timer_;
+    *head = handler;
+    handler->pprev_timer_ = head;
+}
+
+void
+TimerWheel::unlink(TimerHandler *handler)
+{
+    *handler->pprev_timer_ = handler->next_timer_;
+    if (handler->next_timer_)
+        handler->next_timer_->pprev_timer_ = handler->pprev_timer_;
+    handler->next_timer_ = nullptr;
+    handler->pprev_timer_ = nullptr;
+}
+
+void
+TimerWheel::arm(TimerHandler *handler, double timeout)
+{
+    assert(event_loop_);
+    if (handler->armed())
+        unlink(handler);
+    else if (size_++ == 0) {
+        // wheel was not ticking while empty
+        now_ = ticks(ev_now(event_loop_));
+        ev_timer_start(event_loop_, &tick_watcher_);
+    }
+    // partial tick is rounded up, so timer never expires early
+    handler->expires_ = ticks(ev_now(event_loop_)) + (uint64_t) ceil(timeout / tick_) + 1;
+    link(handler);
+}
+
+void
+TimerWheel::cancel(TimerHandler *handler)
+{
+    if (!handler->armed())
+        return;
+    unlink(handler);
+    --size_;
+}
+
+unsigned
+TimerWheel::cascade(unsigned level)
+{
+    unsigned idx = (now_ >> (level * SLOT_BITS)) & (SLOTS - 1);
+    TimerHandler *list = slots_[level][idx];
+    slots_[level][idx] = nullptr;
+    while (list) {
+        TimerHandler *next = list->next_timer_;
+        link(list);
+        list = next;
+    }
+    return idx;
+}
+
+void
+TimerWheel::run(uint64_t until)
+{
+    while (now_ <= until && size_) {
+        unsigned idx = now_ & (SLOTS - 1);
+        // first level wrapped: bring down timers of next slot of upper levels
+        if (!idx) {
+            for (unsigned level = 1; level < LEVELS && cascade(level) == 0; ++level)
+                ;
+        }
+        // timers armed by handlers go to later ticks
+        ++now_;
+        TimerHandler **slot = &slots_[0][idx];
+        while (*slot) {
+            // handler may destroy itself or cancel others
+            TimerHandler *handler = *slot;
+            unlink(handler);
+            --size_;
+            handler->expired();
+        }
+    }
+    if (!size_)
+        now_ = until + 1;
+}
+
+void
+TimerWheel::tick_callback(EV_P_ ev_timer *w, int revents)
+{
+    TimerWheel *self = (TimerWheel *) w->data;
+    self->run(self->ticks(ev_now(EV_A)));
+    if (!self->size_)
+        ev_timer_stop(EV_A, w);
+}
@@ -0,0 +1,87 @@
+#ifndef __cd_timer_wheel_h
+#define __cd_timer_wheel_h
+
+#include <cstddef>
+#include <cstdint>
+#include <ev.h>
+
+class TimerWheel;
+
+/* Receiver of timeout. It is linked into TimerWheel slot through own
+   members, so arming allocates nothing and cancel is an unlink. */
+class TimerHandler
+{
+    friend class TimerWheel;
+    TimerHandler *next_timer_ = nullptr;
+    // link which points to this, nullptr when not armed
+    TimerHandler **pprev_timer_ = nullptr;
+    uint64_t expires_ = 0;
+
+public:
+    // called in thread of event loop which the wheel is attached to
+    virtual void expired() = 0;
+
+    bool
+    armed() const
+    {
+        return pprev_timer_ != nullptr;
+    }
+};
+
+/* Hierarchical timer wheel of one event loop, as in classic Linux timers:
+   LEVELS wheels of SLOTS lists each, level n slot spans SLOTS^n ticks.
+   Timer is put into the level which covers its delay, so arm and cancel
+   are O(1) and one ev_timer serves all connections of the loop. When the
+   first level wraps, the next slot of the upper level is cascaded down.
+   Timeouts are rounded up to tick and fire not earlier than requested;
+   delays beyond the range of wheel are clamped to it. */
+class TimerWheel
+{
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1 << SLOT_BITS;
+    static const unsigned LEVELS = 4;
+
+    TimerHandler *slots_[LEVELS][SLOTS] = {};
+    const double tick_;
+    // next tick to run
+    uint64_t now_ = 0;
+    size_t size_ = 0;
+    struct ev_loop *event_loop_ = nullptr;
+    ev_timer tick_watcher_;
+
+    TimerWheel(const TimerWheel &) = delete;
+
+    uint64_t
+    ticks(ev_tstamp time) const
+    {
+        return (uint64_t) (time / tick_);
+    }
+
+    void link(TimerHandler *handler);
+    void unlink(TimerHandler *handler);
+    // moves timers of level slot to lower levels; returns slot index
+    unsigned cascade(unsigned level);
+    void run(uint64_t until);
+
+    static void tick_callback(EV_P_ ev_timer *w, int revents);
+
+public:
+    // tick is wheel resolution in seconds
+    explicit TimerWheel(double tick);
+    ~TimerWheel();
+
+    void attach(struct ev_loop *event_loop);
+    void detach();
+
+    // (Re)arms handler to expire after timeout seconds
+    void arm(TimerHandler *handler, double timeout);
+    void cancel(TimerHandler *handler);
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+};
+
+#endif // __cd_timer_wheel_h
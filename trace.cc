@@ -0,0 +1,101 @@
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <time.h>
+#include "main_opts.h"
+#include "trace.h"
+#include "metrics.h"
+#include "util.h"
+
+Tracer tracer;
+size_t TraceRing::capacity = 65536;
+
+void
+TraceRing::init()
+{
+    records_.reset(new TraceRecord[capacity]);
+    size_ = capacity;
+}
+
+size_t
+TraceRing::drain(FILE *file, uint16_t thread)
+{
+    static thread_local std::vector<TraceRecord> batch;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    batch.clear();
+    for (; tail != head; ++tail) {
+        batch.push_back(records_[tail & (size_ - 1)]);
+        batch.back().thread = thread;
+    }
+    // records are copied, the owner may overwrite them
+    tail_.store(tail, std::memory_order_release);
+    uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped != dropped_reported_) {
+        TraceRecord r = {};
+        r.time = now_ns();
+        r.arg0 = dropped - dropped_reported_;
+        r.event = TRACE_DROPPED;
+        r.thread = thread;
+        batch.push_back(r);
+        dropped_reported_ = dropped;
+    }
+    if (!batch.empty() && fwrite(batch.data(), sizeof(TraceRecord), batch.size(), file) != batch.size())
+        throw Errno("trace write");
+    return batch.size();
+}
+
+void
+Tracer::open(const char *path, size_t ring_size)
+{
+    size_t capacity = 1;
+    while (capacity < ring_size)
+        capacity <<= 1;
+    TraceRing::capacity = capacity;
+    file_ = fopen(path, "w");
+    if (!file_)
+        throw Errno("fopen ", path);
+    TraceHeader header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(TraceRecord);
+    header.event_count = TRACE_EVENT_COUNT;
+    header.start_monotonic = now_ns();
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_realtime = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (fwrite(&header, sizeof(header), 1, file_) != 1)
+        throw Errno("trace write");
+}
+
+void
+Tracer::start()
+{
+    enabled_.store(true, std::memory_order_relaxed);
+    drain_thread_ = std::thread(&Tracer::drain_loop, this);
+    drain_thread_.detach();
+}
+
+void
+Tracer::record(TraceEvent event, uint64_t arg0, uint64_t arg1)
+{
+    rings_.local().push(event, now_ns(), arg0, arg1);
+}
+
+void
+Tracer::drain_loop()
+{
+    try {
+        while (true) {
+            size_t written = 0;
+            rings_.for_each([&](TraceRing &ring, size_t index) {
+                written += ring.drain(file_, index);
+            });
+            if (written)
+                fflush(file_);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    } catch (std::exception &ex) {
+        enabled_.store(false, std::memory_order_relaxed);
+        std::cerr << ex.what() << "\n";
+    }
+}
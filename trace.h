@@ -0,0 +1,140 @@
+#ifndef __cd_trace_h
+#define __cd_trace_h
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include "thread_slots.h"
+
+/* Binary event trace. Thread appends fixed-size records to its own
+   single-producer ring, background thread drains all rings into file.
+   Event codes and formats are defined at compile time in trace.def,
+   formatting is done offline by trace-decode. When ring is full, events
+   are dropped and counted, the traced thread never waits. */
+
+enum TraceEvent : uint16_t {
+#define TRACE_EVENT(name, format) TRACE_##name,
+#include "trace.def"
+#undef TRACE_EVENT
+    TRACE_EVENT_COUNT
+};
+
+constexpr const char *TRACE_FORMATS[TRACE_EVENT_COUNT] = {
+#define TRACE_EVENT(name, format) format,
+#include "trace.def"
+#undef TRACE_EVENT
+};
+
+constexpr const char *TRACE_NAMES[TRACE_EVENT_COUNT] = {
+#define TRACE_EVENT(name, format) #name,
+#include "trace.def"
+#undef TRACE_EVENT
+};
+
+struct TraceRecord
+{
+    // CLOCK_MONOTONIC nanoseconds
+    uint64_t time;
+    uint64_t arg0;
+    uint64_t arg1;
+    uint16_t event;
+    // index of thread ring, filled by drain thread
+    uint16_t thread;
+    uint32_t reserved;
+};
+
+static const char TRACE_MAGIC[] = "cdtrace1";
+
+// beginning of trace file, records follow
+struct TraceHeader
+{
+    // TRACE_MAGIC without terminating zero
+    char magic[8];
+    uint32_t record_size;
+    uint32_t event_count;
+    // the same moment by CLOCK_MONOTONIC and CLOCK_REALTIME
+    uint64_t start_monotonic;
+    uint64_t start_realtime;
+};
+
+class TraceRing
+{
+    std::unique_ptr<TraceRecord[]> records_;
+    // zero until ring memory is allocated, so that the first push takes slow path
+    size_t size_ = 0;
+    // written by owner thread
+    alignas(CACHE_LINE) std::atomic<uint64_t> head_{0};
+    uint64_t tail_cache_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+    // written by drain thread
+    alignas(CACHE_LINE) std::atomic<uint64_t> tail_{0};
+    uint64_t dropped_reported_ = 0;
+
+public:
+    // capacity: power of 2, ring memory is allocated on first push
+    static size_t capacity;
+
+    void
+    push(TraceEvent event, uint64_t time, uint64_t arg0, uint64_t arg1)
+    {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ >= size_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (!records_)
+                init();
+            if (head - tail_cache_ >= size_) {
+                dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        TraceRecord &r = records_[head & (size_ - 1)];
+        r.time = time;
+        r.arg0 = arg0;
+        r.arg1 = arg1;
+        r.event = event;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Called by drain thread; returns number of written records
+    size_t drain(FILE *file, uint16_t thread);
+
+private:
+    void init();
+};
+
+class Tracer
+{
+    std::atomic<bool> enabled_{false};
+    FILE *file_ = nullptr;
+    std::thread drain_thread_;
+    ThreadSlots<TraceRing> rings_;
+
+    void drain_loop();
+
+public:
+    // Creates trace file; ring_size is in records per thread
+    void open(const char *path, size_t ring_size);
+    // Starts drain thread and recording, after daemonize()
+    void start();
+
+    bool
+    enabled() const
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void record(TraceEvent event, uint64_t arg0, uint64_t arg1);
+};
+
+extern Tracer tracer;
+
+inline void
+trace(TraceEvent event, uint64_t arg0 = 0, uint64_t arg1 = 0)
+{
+    if (__builtin_expect(tracer.enabled(), 0))
+        tracer.record(event, arg0, arg1);
+}
+
+#endif // __cd_trace_h
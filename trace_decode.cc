@@ -0,0 +1,63 @@
+/* Decoder of binary trace written by server-demo --trace: prints records of
+   all threads ordered by time, one per line:
+
+       <microseconds since trace start> <thread> <event> <message>
+
+   Usage: trace-decode <trace file> */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "trace.h"
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+    FILE *file = fopen(argv[1], "r");
+    if (!file) {
+        perror(argv[1]);
+        return 2;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 2;
+    }
+    if (header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: record size %u, expected %zu\n", argv[1], header.record_size,
+                sizeof(TraceRecord));
+        return 2;
+    }
+
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+        records.push_back(record);
+    fclose(file);
+    // file is ordered by drain rounds, each thread's records are in order
+    std::stable_sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) {
+        return a.time < b.time;
+    });
+
+    time_t start = header.start_realtime / 1000000000;
+    char date[64];
+    strftime(date, sizeof(date), "%F %T %z", localtime(&start));
+    printf("# trace started %s, %zu records\n", date, records.size());
+    for (auto &r: records) {
+        double us = ((int64_t) (r.time - header.start_monotonic)) / 1e3;
+        if (r.event >= TRACE_EVENT_COUNT) {
+            printf("%14.3f %5u unknown event %u\n", us, r.thread, r.event);
+            continue;
+        }
+        printf("%14.3f %5u %-14s ", us, r.thread, TRACE_NAMES[r.event]);
+        printf(TRACE_FORMATS[r.event], (unsigned long long) r.arg0, (unsigned long long) r.arg1);
+        putchar('\n');
+    }
+    return 0;
+}
@@ -0,0 +1,297 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "uring.h"
+#include "util.h"
+
+static inline int
+io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static inline int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+URing::URing(unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // every connection may have operation in flight: don't let CQ be the limit
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    ring_fd_ = io_uring_setup(entries, &p);
+    if (ring_fd_ < 0)
+        throw Errno("io_uring_setup");
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size_ > sq_size_)
+            sq_size_ = cq_size_;
+    }
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED)
+        throw Errno("mmap SQ");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr_ = sq_ptr_;
+        cq_size_ = 0;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED)
+            throw Errno("mmap CQ");
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *) mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+        throw Errno("mmap SQEs");
+
+    char *sq = (char *) sq_ptr_;
+    sq_head_ = (unsigned *) (sq + p.sq_off.head);
+    sq_tail_ = (unsigned *) (sq + p.sq_off.tail);
+    sq_flags_ = (unsigned *) (sq + p.sq_off.flags);
+    sq_array_ = (unsigned *) (sq + p.sq_off.array);
+    sq_mask_ = *(unsigned *) (sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    char *cq = (char *) cq_ptr_;
+    cq_head_ = (unsigned *) (cq + p.cq_off.head);
+    cq_tail_ = (unsigned *) (cq + p.cq_off.tail);
+    cq_mask_ = *(unsigned *) (cq + p.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* Eventfd is signalled only for completions done asynchronously.
+       Completions done inline by io_uring_enter() are drained right after submit. */
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0)
+        throw Errno("eventfd");
+    if (io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD_ASYNC, &event_fd_, 1) < 0)
+        throw Errno("io_uring_register");
+}
+
+URing::~URing()
+{
+    detach();
+    if (sqes_ && sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_size_);
+    if (cq_size_ && cq_ptr_ && cq_ptr_ != MAP_FAILED)
+        munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_ && sq_ptr_ != MAP_FAILED)
+        munmap(sq_ptr_, sq_size_);
+    if (event_fd_ >= 0)
+        ::close(event_fd_);
+    if (ring_fd_ >= 0)
+        ::close(ring_fd_);
+    // kernel drops provided buffers with the ring
+    if (buffers_)
+        munmap(buffers_, buf_count_ * buf_size_);
+}
+
+void
+URing::attach(struct ev_loop *event_loop)
+{
+    event_loop_ = event_loop;
+    ev_io_init(&event_watcher_, event_callback, event_fd_, EV_READ);
+    ev_prepare_init(&prepare_watcher_, prepare_callback);
+    event_watcher_.data = this;
+    prepare_watcher_.data = this;
+    ev_io_start(event_loop_, &event_watcher_);
+    ev_prepare_start(event_loop_, &prepare_watcher_);
+}
+
+void
+URing::detach()
+{
+    if (event_loop_) {
+        ev_io_stop(event_loop_, &event_watcher_);
+        ev_prepare_stop(event_loop_, &prepare_watcher_);
+        event_loop_ = nullptr;
+    }
+}
+
+void
+URing::event_callback(EV_P_ ev_io *w, int revents)
+{
+    URing *self = (URing *) w->data;
+    eventfd_t value;
+    eventfd_read(self->event_fd_, &value);
+    self->drain();
+}
+
+void
+URing::prepare_callback(EV_P_ ev_prepare *w, int revents)
+{
+    // handlers called by drain() may queue new operations, so repeat until idle
+    URing *self = (URing *) w->data;
+    do {
+        self->submit();
+    } while (self->drain() && self->to_submit_);
+}
+
+int
+URing::submit()
+{
+    unsigned flags = 0;
+    if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+        flags |= IORING_ENTER_GETEVENTS;
+    if (!to_submit_ && !flags)
+        return 0;
+    int submitted = io_uring_enter(ring_fd_, to_submit_, 0, flags);
+    if (submitted < 0) {
+        if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+            return 0;
+        throw Errno("io_uring_enter");
+    }
+    to_submit_ -= submitted;
+    return submitted;
+}
+
+unsigned
+URing::drain()
+{
+    unsigned head = *cq_head_;
+    unsigned count = 0;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        // release CQE slot before calling handler: handler may submit and wait
+        __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+        ++count;
+        URingHandler *handler = (URingHandler *) (user_data & ~OP_MASK);
+        if (handler)
+            handler->complete(user_data & OP_MASK, res, flags);
+    }
+    return count;
+}
+
+io_uring_sqe *
+URing::get_sqe(URingHandler *handler, int op, int opcode, int fd)
+{
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        // SQ is full: pass queued entries to kernel right now
+        submit();
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            throw std::runtime_error("io_uring submission queue overflow");
+    }
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t) (uintptr_t) handler | (op & OP_MASK);
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+io_uring_sqe *
+URing::accept(URingHandler *handler, int op, int fd, int flags, bool multishot)
+{
+    io_uring_sqe *sqe = get_sqe(handler, op, IORING_OP_ACCEPT, fd);
+    sqe->accept_flags = flags;
+    if (multishot)
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    return sqe;
+}
+
+io_uring_sqe *
+URing::recv(URingHandler *handler, int op, int fd, void *buf, size_t len, int flags)
+{
+    io_uring_sqe *sqe = get_sqe(handler, op, IORING_OP_RECV, fd);
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    return sqe;
+}
+
+void
+URing::provide_buffers(unsigned count, size_t size)
+{
+    void *area = mmap(nullptr, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        throw Errno("mmap provided buffers");
+    buffers_ = (char *) area;
+    buf_count_ = count;
+    buf_size_ = size;
+    // the operation is done by next submit(), before recv queued after it
+    add_buffers(0, count);
+}
+
+void
+URing::add_buffers(unsigned id, unsigned count)
+{
+    // no completion on success: nobody waits for it
+    io_uring_sqe *sqe = get_sqe(nullptr, 0, IORING_OP_PROVIDE_BUFFERS, count);
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    sqe->addr = (uint64_t) (uintptr_t) (buffers_ + id * buf_size_);
+    sqe->len = buf_size_;
+    sqe->off = id;
+    sqe->buf_group = BUFFER_GROUP;
+}
+
+void
+URing::recycle_buffer(unsigned id)
+{
+    add_buffers(id, 1);
+}
+
+io_uring_sqe *
+URing::recv_provided(URingHandler *handler, int op, int fd, int flags)
+{
+    io_uring_sqe *sqe = get_sqe(handler, op, IORING_OP_RECV, fd);
+    sqe->msg_flags = flags;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    return sqe;
+}
+
+io_uring_sqe *
+URing::poll(URingHandler *handler, int op, int fd, unsigned events)
+{
+    io_uring_sqe *sqe = get_sqe(handler, op, IORING_OP_POLL_ADD, fd);
+    sqe->poll32_events = events;
+    return sqe;
+}
+
+io_uring_sqe *
+URing::sendmsg(URingHandler *handler, int op, int fd, const struct msghdr *msg, int flags, bool zerocopy)
+{
+    /* Zero-copy send completes twice: with result (IORING_CQE_F_MORE is set)
+       and then with IORING_CQE_F_NOTIF when kernel does not use buffers anymore. */
+    io_uring_sqe *sqe = get_sqe(handler, op, zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG, fd);
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    return sqe;
+}
+
+io_uring_sqe *
+URing::close(URingHandler *handler, int op, int fd)
+{
+    return get_sqe(handler, op, IORING_OP_CLOSE, fd);
+}
+
+io_uring_sqe *
+URing::cancel(URingHandler *handler, int op, URingHandler *target, int target_op)
+{
+    io_uring_sqe *sqe = get_sqe(handler, op, IORING_OP_ASYNC_CANCEL, -1);
+    sqe->addr = (uint64_t) (uintptr_t) target | (target_op & OP_MASK);
+    return sqe;
+}
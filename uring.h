@@ -0,0 +1,113 @@
+#ifndef __cd_uring_h
+#define __cd_uring_h
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <ev.h>
+
+/* Receiver of io_uring completions. Operation code (op) is kept in lower bits
+   of user_data, so handler must be aligned at least to 1 << URing::OP_BITS. */
+class URingHandler
+{
+public:
+    virtual void complete(int op, int res, unsigned flags) = 0;
+};
+
+/* Minimal io_uring wrapper on raw syscalls, driven by libev event loop:
+   submission is done once per loop iteration (in ev_prepare watcher),
+   completions are signalled through eventfd watched by loop. */
+class URing
+{
+public:
+    static const unsigned OP_BITS = 3;
+    static const uint64_t OP_MASK = (1 << OP_BITS) - 1;
+
+private:
+    int ring_fd_ = -1;
+    int event_fd_ = -1;
+
+    void *sq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    void *cq_ptr_ = nullptr;
+    size_t cq_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned *sq_flags_;
+    unsigned *sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+
+    // SQEs filled, but not yet passed to kernel
+    unsigned to_submit_ = 0;
+
+    // buffers provided to kernel for recv (see provide_buffers()), one group per ring
+    static const unsigned BUFFER_GROUP = 0;
+    char *buffers_ = nullptr;
+    unsigned buf_count_ = 0;
+    size_t buf_size_ = 0;
+
+    struct ev_loop *event_loop_ = nullptr;
+    ev_io event_watcher_;
+    ev_prepare prepare_watcher_;
+
+    URing(const URing &) = delete;
+
+    static void event_callback(EV_P_ ev_io *w, int revents);
+    static void prepare_callback(EV_P_ ev_prepare *w, int revents);
+
+    io_uring_sqe *get_sqe(URingHandler *handler, int op, int opcode, int fd);
+    void add_buffers(unsigned id, unsigned count);
+
+public:
+    URing(unsigned entries);
+    ~URing();
+
+    void attach(struct ev_loop *event_loop);
+    void detach();
+
+    int submit();
+    unsigned drain();
+
+    io_uring_sqe *accept(URingHandler *handler, int op, int fd, int flags, bool multishot);
+    io_uring_sqe *recv(URingHandler *handler, int op, int fd, void *buf, size_t len, int flags);
+
+    /* Gives kernel count buffers of size bytes (IORING_OP_PROVIDE_BUFFERS),
+       it takes one of them when data of recv_provided() arrives. */
+    void provide_buffers(unsigned count, size_t size);
+    bool
+    provided_buffers() const
+    {
+        return buffers_ != nullptr;
+    }
+    /* Received data is in buffer(id), id is given by completion flags (IORING_CQE_F_BUFFER).
+       Buffer must be given back by recycle_buffer() when data is taken. */
+    io_uring_sqe *recv_provided(URingHandler *handler, int op, int fd, int flags);
+    static unsigned
+    buffer_id(unsigned flags)
+    {
+        return flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    const char *
+    buffer(unsigned id) const
+    {
+        return buffers_ + id * buf_size_;
+    }
+    void recycle_buffer(unsigned id);
+    // one-shot readiness wait, res is mask of signalled events
+    io_uring_sqe *poll(URingHandler *handler, int op, int fd, unsigned events);
+    // msg must stay valid until operation completes
+    io_uring_sqe *sendmsg(URingHandler *handler, int op, int fd, const struct msghdr *msg, int flags, bool zerocopy);
+    io_uring_sqe *close(URingHandler *handler, int op, int fd);
+    io_uring_sqe *cancel(URingHandler *handler, int op, URingHandler *target, int target_op);
+};
+
+#endif // __cd_uring_h